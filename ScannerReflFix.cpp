@@ -1,250 +1,859 @@
-/*
-Copyright (c) <2018> <doug gray>
-
-Permission is hereby granted, free of charge, to any person obtaining a copy
-of this software and associated documentation files (the "Software"), to deal
-in the Software without restriction, including without limitation the rights
-to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
-copies of the Software, and to permit persons to whom the Software is
-furnished to do so, subject to the following conditions:
-
-The above copyright notice and this permission notice shall be included in all
-copies or substantial portions of the Software.
-
-THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
-AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
-LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-SOFTWARE.
-*/
-
-#include <vector>
-#include <iostream>
-#include "ArgumentParse.h"
-#include "tiffresults.h"
-#include <array>
-#include <fstream>
-#include <algorithm>
-#include <future>
-
-//using namespace std;
-using std::vector;
-using std::string;
-using std::cout;
-using std::cin;
-using std::endl;
-
-string profile_name{ "" };              // optional file name of profile to attach to corrected image
-int force_ouput_bits = 0;               // Force 16 bit output file. 8 bit input files default to 8 bit output files
-bool adjust_to_detected_white = false;  // Scales output values so that the largest .01% of pixels are maxed (255)
-bool save_intermediate_files = false;   // Saves various intermediate files for debugging
-bool no_gain_restore = false;           // Just subtract reflected light estimate. Normal operation restores L* match
-bool simulate_reflected_light = false;  // generate an image estimate of scanner's re-reflected light addition.
-float edge_reflectance=.85f;            // average reflected light of area outside of scan crop (if black: .01)
-bool print_line_and_time = false;       // print line number and time since start for each major phase of process
-bool correct_image_in_aRGB = false;     // correct image from sacnner that has been converted to Adobe RGB
-bool average_files_only = false;        // No reflection processing, useful for averaging multiple TIFF files
-
-int main(int argc, char const **argv)
-{
-    Timer timer;
-    vector<string> cmdArgs = vectorize_commands(argc, argv);
-
-    // process options, all options must be valid and at least one file argument remaining
-    try
-    {
-        procFlag("-A", cmdArgs, correct_image_in_aRGB);
-        procFlag("-S", cmdArgs, edge_reflectance);
-        procFlag("-W", cmdArgs, adjust_to_detected_white);
-        procFlag("-P", cmdArgs, profile_name);
-        procFlag("-R", cmdArgs, simulate_reflected_light);
-        procFlag("-I", cmdArgs, save_intermediate_files);
-        procFlag("-N", cmdArgs, no_gain_restore);
-		procFlag("-F", cmdArgs, force_ouput_bits);
-		procFlag("-T", cmdArgs, print_line_and_time);
-        procFlag("-Z", cmdArgs, average_files_only);
-
-		if (cmdArgs.size() == 1)
-            throw("command line error\n");
-        if (force_ouput_bits!=0 && force_ouput_bits!=8 && force_ouput_bits!=16)
-            throw("-F n:   n must be either 8 or 16\n");
-    }
-    catch (const char *e)
-    {
-        cout << e << endl;
-        cout << "Version 1.1:\n"
-            "Usage: scannerreflfix [ zero or more options] infile.tif outfile.tif\n" <<
-            "  -A                   Correct Image Already in Adobe RGB\n" <<
-            "  -F 8|16              Force 8 or 16 bit tif output]\n" <<
-            "  -W                   Maximize white (Like Relative Col with tint retention)\n" <<
-            "  -P profile           Attach profile <profile.icc>\n" <<
-            "  -S edge_refl         ave refl outside of scanned area (0 to 1, default: .85)\n\n" <<
-			"                       Test options\n" <<
-			"  -I                   Save intermediate files\n" <<
-			"  -T                   Show line numbers and accumulated time.\n" <<
-			"  -N                   Don't Restore gain after subtracting reflection (Diagnostic only)\n" <<
-			"  -R                   Simulated scanner by adding reflected light\n" <<
-            "  -Z                   Average multiple input files with No Refl. Correction.\n\n" <<
-            "scannerreflfix.exe models and removes re-reflected light from an area\n"
-			"approx 1\" around scanned RGB values for the Epson V850 scanner.\n";
-            exit(0);
-    }
-
-    // Create an image with simulated reflected light added from standard tif image
-    // useful for simulating the effect of the re-reflected scanner light
-    if (simulate_reflected_light) {
-        cout <<"Simulating reflected light for V800/V850\n";
-    }
-    else if (!average_files_only)
-        cout <<"Correcting reflected light for V800/V850\n";
-    else
-        cout << "No File Processing\n";
-    try {
-		// get first argument (uncorrected from image)
-        int argCnt=(int)cmdArgs.size();
-        ArrayRGB image_in = TiffRead(cmdArgs[1].c_str(), correct_image_in_aRGB ? 2.2f : 1.7f);
-
-        // add additional images then calculate the mean
-        if (average_files_only && argCnt - 2 > 0)
-            cout << "Averaging " << argCnt - 2 << " files into " << cmdArgs[argCnt-1].c_str() << "\n";
-        for (int i = 2; i < argCnt-1; i++)
-        {
-            ArrayRGB additional_image_in = TiffRead(cmdArgs[i].c_str(), correct_image_in_aRGB ? 2.2f : 1.7f);
-            if (additional_image_in.v[0].size() != image_in.v[0].size())
-                throw "Additional input images are not the same size";
-            for (int i = 0; i < 3; i++) {
-                for (int ii = 0; ii < additional_image_in.v[i].size(); ii++)
-                {
-                    image_in.v[i][ii] += additional_image_in.v[i][ii];
-                }
-            }
-        }
-        if (argCnt - 3 > 0)
-        for (int i=0; i < 3; i++)
-            for (auto& x : image_in.v[i])
-                x = x / (argCnt - 2);
-
-        if (!average_files_only)
-        {
-            // Get image that represents the light spread that is additive to the center's pixel location
-            // x2: number of times DPI divisable by 2, x3:  number of times DPI divisable by 3
-            auto[refl_area, x2, x3] = getReflArea(image_in.dpi);
-            if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-
-
-            // Add 1" margin around image_in since light is re-reflected over around an inch
-            int margins = image_in.dpi;
-            ArrayRGB in_expanded{ image_in.nr + 2 * margins, image_in.nc + 2 * margins, image_in.dpi, image_in.from_16bits, image_in.gamma };
-            in_expanded.fill(edge_reflectance, edge_reflectance, edge_reflectance);             // assume border "white" reflected 85% of kight.
-            in_expanded.copy(image_in, margins, margins);   // insert into expanded image with 1" margins
-
-            // for getting estimated reflected light spread
-            if (save_intermediate_files)
-            {
-                cout << "Saving reflarray.tif, image of additional reflected light in gamma = 2.2" << endl;
-                refl_area.gamma = 2.2f;      // write gamma for compatibility with aRGB
-                TiffWrite("reflArray.tif", refl_area, "", false);
-            }
-            if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-
-            // Create downsized image to calculate reflected light from
-            // This does not require or need high resolution.
-            ArrayRGB image_reduced = in_expanded;
-            int reduction = image_in.dpi / refl_area.dpi;
-
-            // Downsize image to create a reflected light version, use 3x downsize initially for speed
-            while (x3--)
-                image_reduced = downsample(image_reduced, 3);
-            while (x2--)
-                image_reduced = downsample(image_reduced, 2);
-            if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-
-
-            // save downsampled file with added margin
-            if (save_intermediate_files)
-            {
-                cout << "Saving imagorig.tif, reduced original file with surround in gamma=2.2" << endl;
-                image_reduced.gamma = 2.2f;      // write gamma for compatibility wiht aRGB
-                TiffWrite("imageorig.tif", image_reduced, "");
-            }
-
-
-            if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-            ArrayRGB image_correction = generate_reflected_light_estimate(image_reduced, refl_area);
-            if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-
-            // save the estimated re-reflected light from the full scanned image and surround
-            if (save_intermediate_files)
-            {
-                cout << "Saving refl_light.tif, image of estimated reflected light" << endl;
-                image_correction.gamma = 2.2f;      // write gamma for compatibility with aRGB and sRGB
-                TiffWrite("refl_light.tif", image_correction, "");
-            }
-
-            // Subtract re-reflected light from original
-            for (int color = 0; color < 3; color++)
-            {
-                for (int i = 0; i < image_in.nr; i++)
-                {
-                    for (int ii = 0; ii < image_in.nc; ii++)
-                    {
-                        //auto tmp = image_in(i, ii, color)-image_correction(i/reduction, ii/reduction, color)*image_in(i, ii, color);
-                        float tmp;
-                        if (simulate_reflected_light) {
-                            tmp = image_in(i, ii, color) + bilinear(image_correction, i, ii, reduction, color)*image_in(i, ii, color);
-                            tmp *= .785f / .876f;
-                        }
-                        else {
-                            tmp = image_in(i, ii, color) - bilinear(image_correction, i, ii, reduction, color)*image_in(i, ii, color);
-                            // gain restore  adjusts gain to offset reduction from re-reflected light subtraction
-                            tmp = tmp * (no_gain_restore ? 1.0f : .876f / .785f);
-                        }
-                        image_in(i, ii, color) = std::clamp(tmp, 0.f, 1.f);
-                    }
-                }
-            }
-
-            // Adjust for Relative Colorimetric w/o shift to WP (no tint change)
-            // Should not be used to process scanner profiling patch scans
-            if (adjust_to_detected_white)
-            {
-                float maxcolor = 0;
-                for (int i = 0; i < 3; i++)
-                {
-                    vector<float> color(image_in.v[i]);
-                    sort(color.begin(), color.end());
-                    float high = *(color.end() - (1 + color.size() / 10000));
-                    if (high > maxcolor) maxcolor = high;
-                }
-                image_in.scale(1 / maxcolor);
-            }
-
-        }
-		if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-		if (force_ouput_bits==16)
-            image_in.from_16bits = true;
-        else if (force_ouput_bits == 8)
-            image_in.from_16bits = false;
-
-        TiffWrite(cmdArgs[argCnt-1].c_str(), image_in, profile_name);
-		if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-
-    }
-    catch (const char *e)
-    {
-        cout << e << "\nPress enter to exit\n";
-        char tmp[10];
-        cin.getline(tmp, 1);
-    }
-    catch (const std::exception &e)
-    {
-        cout << e.what() << endl;
-    }
-    catch (...) {
-        cout << "unknown exception\n";
-    }
-
-}
-
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <vector>
+#include <iostream>
+#include "ArgumentParse.h"
+#include "tiffresults.h"
+#include "reflectioncorrector.h"
+#include "imageaverage.h"
+#include "trace.h"
+#include <array>
+#include <fstream>
+#include <algorithm>
+#include <future>
+#include <system_error>
+#include <set>
+#include <sstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <type_traits>
+#include <numeric>
+#include <functional>
+
+//using namespace std;
+using std::vector;
+using std::string;
+using std::cout;
+using std::cin;
+using std::endl;
+
+string profile_name{ "" };              // optional file name of profile to attach to corrected image
+int force_ouput_bits = 0;               // Force 16 bit output file. 8 bit input files default to 8 bit output files
+bool adjust_to_detected_white = false;  // Scales output values so that the largest .01% of pixels are maxed (255)
+bool save_intermediate_files = false;   // Saves various intermediate files for debugging
+bool no_gain_restore = false;           // Just subtract reflected light estimate. Normal operation restores L* match
+bool simulate_reflected_light = false;  // generate an image estimate of scanner's re-reflected light addition.
+float edge_reflectance=.85f;            // average reflected light of area outside of scan crop (if black: .01)
+bool print_line_and_time = false;       // print line number and time since start for each major phase of process
+bool correct_image_in_aRGB = false;     // correct image from sacnner that has been converted to Adobe RGB
+bool average_files_only = false;        // No reflection processing, useful for averaging multiple TIFF files
+string convolve_engine{ "direct" };     // reflected light convolution: direct sum, fft (overlap-save), svd (separable) or multires (near/far field)
+float svd_max_error = .0001f;           // -C svd: largest allowed change in any correction value
+int thread_count = 0;                   // worker threads for all stages, 0: one per hardware thread
+int stream_rows = 0;                    // if not 0, process the image in strips of this many rows (bounded memory)
+string output_compression{ "none" };    // output tif compression: none, lzw, zip[:level] or zstd[:level]
+bool batch_mode = false;                // file arguments are input/output pairs or a manifest of them
+string kernel_cache_dir{ "" };          // if not empty, directory of cached reflection kernels
+string pixel_storage{ "float" };        // full resolution image samples: float, half or uint16
+string average_stat{ "mean" };          // combining several input files: mean, median or clip[:sigma]
+string trace_file{ "" };                // if not empty, write a Chrome trace of the processing stages here
+string roi_spec{ "" };                  // if not empty, x,y,w,h: correct and write only this rectangle
+int preview_width = 0;                  // if not 0, write a preview this wide from the reduced image only
+int tile_size = 0;                      // if not 0, write tiled tifs with tiles this wide and long
+string scratch_dir{ "" };               // if not empty, keep large image planes in memory mapped files here
+string sweep_edges{ "" };               // if not empty, comma separated -S values to correct with from one convolution
+string sweep_gains{ "" };               // if not empty, comma separated gain restore factors for the sweep
+bool sweep_stats_only = false;          // sweep prints statistics for each value instead of writing files
+
+// Output tif compression and layout from -O and --tile
+TiffCompression output_format()
+{
+    TiffCompression format = tiff_compression(output_compression);
+    format.tile = tile_size;
+    return format;
+}
+
+// The correction engine, set up from the options the first time it is used (after they are parsed)
+const ReflectionCorrector &corrector()
+{
+    static const ReflectionCorrector engine([] {
+        CorrectorOptions options;
+        options.edge_reflectance = edge_reflectance;
+        options.simulate = simulate_reflected_light;
+        options.no_gain_restore = no_gain_restore;
+        options.adjust_to_white = adjust_to_detected_white;
+        options.convolve = convolve_mode(convolve_engine);
+        options.svd_max_error = svd_max_error;
+        options.kernel_cache_dir = kernel_cache_dir;
+        return options;
+    }());
+    return engine;
+}
+
+// Kernels are built once per dpi and reused for every image at that dpi.
+// With -K they are also loaded from, or saved to, the on disk kernel cache.
+const Kernel &kernel_for(int dpi)
+{
+    static std::set<int> reported;
+    const Kernel &kernel = corrector().kernel(dpi);
+    if (convolve_mode(convolve_engine) == ConvolveMode::svd && reported.insert(dpi).second)
+        cout << "Separable kernel rank " << kernel.separable.rank() << " of " << kernel.separable.k
+            << ", max reflected light error " << kernel.separable.error[0]
+            << " (kernel rel. error " << kernel.separable.rel_error[0] << ")\n";
+    return kernel;
+}
+
+// Removes (or with -R adds) re-reflected light from a whole image in memory, then applies -W.
+// The same stages as ReflectionCorrector::correct() with -I and -T output between them.
+template<class T>
+void correct_image(ArrayRGBT<T> &image_in, Timer &timer)
+{
+    TraceSpan span("correct", 3.0 * sizeof(T) * image_in.v[0].size());
+    // Get image that represents the light spread that is additive to the center's pixel location
+    const Kernel &kernel = kernel_for(image_in.dpi);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+
+
+    // for getting estimated reflected light spread
+    if (save_intermediate_files)
+    {
+        cout << "Saving reflarray.tif, image of additional reflected light in gamma = 2.2" << endl;
+        ArrayRGB refl_area = kernel.refl_area;
+        refl_area.gamma = 2.2f;      // write gamma for compatibility with aRGB
+        TiffWrite("reflArray.tif", refl_area, "", false);
+    }
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+
+    // Create downsized image to calculate reflected light from
+    // This does not require or need high resolution.
+    ArrayRGB image_reduced = corrector().decimator(kernel, image_in.nr, image_in.nc, image_in.dpi).decimate(image_in);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+
+
+    // save downsampled file with added margin
+    if (save_intermediate_files)
+    {
+        cout << "Saving imagorig.tif, reduced original file with surround in gamma=2.2" << endl;
+        image_reduced.gamma = 2.2f;      // write gamma for compatibility wiht aRGB
+        TiffWrite("imageorig.tif", image_reduced, "");
+    }
+
+
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+    ArrayRGB image_correction = corrector().reflected_light(image_reduced, kernel);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+
+    // save the estimated re-reflected light from the full scanned image and surround
+    if (save_intermediate_files)
+    {
+        cout << "Saving refl_light.tif, image of estimated reflected light" << endl;
+        image_correction.gamma = 2.2f;      // write gamma for compatibility with aRGB and sRGB
+        TiffWrite("refl_light.tif", image_correction, "");
+    }
+
+    // Subtract re-reflected light from original, -W counts the corrected values on the way
+    SampleHistogram histogram;
+    corrector().applier(image_correction, kernel, image_in.dpi, image_in.nc).apply(image_in, 0,
+        adjust_to_detected_white ? &histogram : nullptr);
+    if (adjust_to_detected_white)
+        corrector().adjust_to_white(image_in, histogram);
+}
+
+// Writes the corrected image honoring -F, -P and -O
+template<class T>
+void write_output(const string &outfile, ArrayRGBT<T> &image)
+{
+    if (force_ouput_bits==16)
+        image.from_16bits = true;
+    else if (force_ouput_bits == 8)
+        image.from_16bits = false;
+    TiffWrite(outfile.c_str(), image, profile_name, true, output_format());
+}
+
+// Pass 1 of the streaming paths: every row is decoded once and pushed into the downsampler
+// (and into preview, if not null), then the reflected light is estimated from the reduced image.
+ArrayRGB streamed_correction(const string &infile, float gamma, const Kernel &kernel, Timer &timer, Decimator *preview = nullptr)
+{
+    int rows = stream_rows != 0 ? stream_rows : 256;
+    ArrayRGB image_reduced;
+    {
+        TiffStripReader in(infile.c_str(), gamma);
+        Decimator downsampler = corrector().decimator(kernel, in.nr, in.nc, in.dpi);   // 1" surround
+        while (in.row < in.nr)
+        {
+            ArrayRGB strip = in.read(rows);
+            TraceSpan push_span("downsample", 12.0 * strip.v[0].size());
+            for (int r = 0; r < strip.nr; r++)
+            {
+                downsampler.push(&strip(r, 0, 0), &strip(r, 0, 1), &strip(r, 0, 2));
+                if (preview)
+                    preview->push(&strip(r, 0, 0), &strip(r, 0, 1), &strip(r, 0, 2));
+            }
+        }
+        image_reduced = std::move(downsampler.result());
+    }
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+    if (save_intermediate_files)
+    {
+        cout << "Saving imagorig.tif, reduced original file with surround in gamma=2.2" << endl;
+        image_reduced.gamma = 2.2f;      // write gamma for compatibility wiht aRGB
+        TiffWrite("imageorig.tif", image_reduced, "");
+    }
+
+    ArrayRGB image_correction = corrector().reflected_light(image_reduced, kernel);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+    if (save_intermediate_files)
+    {
+        cout << "Saving refl_light.tif, image of estimated reflected light" << endl;
+        image_correction.gamma = 2.2f;      // write gamma for compatibility with aRGB and sRGB
+        TiffWrite("refl_light.tif", image_correction, "");
+    }
+    return image_correction;
+}
+
+// Two pass version of main's processing for images too large to hold in memory.
+// Pass 1 streams rows into the downsampler, which supplies the 1" surround itself,
+// pass 2 re-reads the file in strips, corrects them and writes them out.
+// Memory is a few strips plus the small reduced images.
+void stream_correct(const string &infile, const string &outfile, Timer &timer)
+{
+    TraceSpan span("correct");
+    float gamma = correct_image_in_aRGB ? 2.2f : 1.7f;
+    const Kernel &kernel = kernel_for(TiffStripReader(infile.c_str(), gamma).dpi);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+    ArrayRGB image_correction = streamed_correction(infile, gamma, kernel, timer);
+
+    TiffStripReader in(infile.c_str(), gamma);
+    bool bits16 = force_ouput_bits == 16 ? true : force_ouput_bits == 8 ? false : in.from_16bits;
+    TiffStripWriter out(outfile.c_str(), in.nr, in.nc, in.dpi, bits16, gamma, profile_name, in.profile,
+        output_format());
+    CorrectionApplier applier = corrector().applier(image_correction, kernel, in.dpi, in.nc);
+    while (in.row < in.nr)
+    {
+        int first_row = in.row;
+        ArrayRGB strip = in.read(stream_rows);
+        applier.apply(strip, first_row);
+        out.write(strip);
+    }
+    out.close();
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+}
+
+// --roi x,y,w,h in full resolution pixels
+struct Roi {
+    int x = 0, y = 0, w = 0, h = 0;
+};
+Roi parse_roi(const string &spec)
+{
+    Roi roi;
+    char sep[3] = {};
+    std::istringstream in(spec);
+    in >> roi.x >> sep[0] >> roi.y >> sep[1] >> roi.w >> sep[2] >> roi.h;
+    if (!in || !in.eof() || string(sep, 3) != ",,," || roi.x < 0 || roi.y < 0 || roi.w <= 0 || roi.h <= 0)
+        throw("--roi x,y,w,h:   x,y is the top left pixel, w,h the size, all integers\n");
+    return roi;
+}
+
+// The reflected light is still estimated from the whole scan (pass 1), but pass 2 only
+// decodes the rows of the rectangle and only corrects and encodes the rectangle.
+// 16 bit output is the same as cropping the full output, 8 bit can differ by 1 since
+// rounding error is carried from the rectangle's left edge instead of the image's.
+void roi_correct(const string &infile, const string &outfile, const Roi &roi, Timer &timer)
+{
+    TraceSpan span("correct");
+    float gamma = correct_image_in_aRGB ? 2.2f : 1.7f;
+    TiffStripReader in(infile.c_str(), gamma);
+    if (roi.x + roi.w > in.nc || roi.y + roi.h > in.nr)
+        throw("--roi x,y,w,h:   rectangle is not inside the image\n");
+    const Kernel &kernel = kernel_for(in.dpi);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+    ArrayRGB image_correction = streamed_correction(infile, gamma, kernel, timer);
+
+    int rows = stream_rows != 0 ? stream_rows : 256;
+    bool bits16 = force_ouput_bits == 16 ? true : force_ouput_bits == 8 ? false : in.from_16bits;
+    TiffStripWriter out(outfile.c_str(), roi.h, roi.w, in.dpi, bits16, gamma, profile_name, in.profile,
+        output_format());
+    CorrectionApplier applier = corrector().applier(image_correction, kernel, in.dpi, roi.w, roi.x);
+    in.seek(roi.y);
+    while (in.row < roi.y + roi.h)
+    {
+        int first_row = in.row;
+        ArrayRGB strip = in.read(std::min(rows, roi.y + roi.h - in.row));
+        strip = strip.subArray(0, strip.nr - 1, roi.x, roi.x + roi.w - 1);
+        applier.apply(strip, first_row);
+        out.write(strip);
+    }
+    out.close();
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+}
+
+// --preview width: pass 1 also decimates the scan to the smallest of the kernel's
+// 3x/2x reduction steps that keeps at least width columns. That image is corrected with
+// the reduced correction field, resized to width and written. No full resolution pass.
+// A preview is never wider than the scan, nor tagged with a higher dpi.
+void preview_correct(const string &infile, const string &outfile, int width, Timer &timer)
+{
+    TraceSpan span("preview");
+    float gamma = correct_image_in_aRGB ? 2.2f : 1.7f;
+    TiffStripReader info(infile.c_str(), gamma);
+    int nr = info.nr, nc = info.nc, dpi = info.dpi;
+    width = std::min(width, nc);
+    const Kernel &kernel = kernel_for(dpi);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+
+    vector<int> rates(kernel.x3, 3);
+    rates.insert(rates.end(), kernel.x2, 2);
+    int rate = std::accumulate(rates.begin(), rates.end(), 1, std::multiplies<int>());
+    while (rates.size() > 1 && nc / rate < width)
+    {
+        rate /= rates.back();
+        rates.pop_back();
+    }
+    Decimator decimator(nr, nc, dpi, rates);
+    ArrayRGB image_correction = streamed_correction(infile, gamma, kernel, timer, &decimator);
+    ArrayRGB &small = decimator.result();
+    corrector().applier(image_correction, kernel, dpi / rate, small.nc).apply(small, 0);
+
+    // bilinear resize, small pixel i is centered on full resolution pixel i*rate
+    int height = std::max(1, static_cast<int>(std::lround(double(width) * nr / nc)));
+    ArrayRGB preview(height, width, static_cast<int>(std::lround(double(dpi) * width / nc)), info.from_16bits, gamma);
+    preview.profile = info.profile;
+    auto source = [rate](int i, int n_out, int n_full, int n_small, int &i0, int &i1, float &w1) {
+        double f = std::clamp(((i + .5) * n_full / n_out - .5) / rate, 0.0, double(n_small - 1));
+        i0 = static_cast<int>(f);
+        i1 = std::min(i0 + 1, n_small - 1);
+        w1 = static_cast<float>(f - i0);
+    };
+    parallel_bands(height, [&](int color, int start_row, int end_row) {
+        for (int r = start_row; r < end_row; r++)
+        {
+            int r0, r1, c0, c1;
+            float wr, wc;
+            source(r, height, nr, small.nr, r0, r1, wr);
+            for (int c = 0; c < width; c++)
+            {
+                source(c, width, nc, small.nc, c0, c1, wc);
+                float top = small(r0, c0, color) * (1 - wc) + small(r0, c1, color) * wc;
+                float bottom = small(r1, c0, color) * (1 - wc) + small(r1, c1, color) * wc;
+                preview(r, c, color) = top * (1 - wr) + bottom * wr;
+            }
+        }
+    });
+    write_output(outfile, preview);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+}
+
+// --sweep-S or --sweep-gain list: the values and the text given for each, which names the
+// output files. With no list the one value from the other options and no text.
+vector<std::pair<float, string>> sweep_values(const string &list, float value, const char *error)
+{
+    vector<std::pair<float, string>> values;
+    if (list.empty())
+        values.emplace_back(value, "");
+    std::istringstream items(list);
+    string item;
+    while (std::getline(items, item, ','))
+    {
+        std::istringstream in(item);
+        if (!(in >> value) || !(in >> std::ws).eof() || value < 0)
+            throw error;
+        values.emplace_back(value, item);
+    }
+    if (values.empty())
+        throw error;
+    return values;
+}
+
+// outfile with _S<edge>_g<gain> before its extension, parts with no text left out
+string sweep_file(const string &outfile, const string &edge, const string &gain)
+{
+    string suffix = (edge.empty() ? "" : "_S" + edge) + (gain.empty() ? "" : "_g" + gain);
+    size_t dot = outfile.find_last_of('.');
+    if (dot == string::npos || outfile.find_first_of("/\\", dot) != string::npos)
+        dot = outfile.size();
+    return outfile.substr(0, dot) + suffix + outfile.substr(dot);
+}
+
+// --sweep-S, --sweep-gain: corrects one scan for every combination of edge reflectance and
+// gain. The reflected light is linear in the reduced image, which is the scan's own part
+// plus the edge reflectance times the margins' part (Decimator::margin_response()). Both
+// parts are convolved once and each edge reflectance's correction is their sum weighted
+// by it, at the reduced size. Each combination then costs an apply pass over the image in
+// memory, plus writing it unless --sweep-stats, a strip at a time.
+template<class T>
+void sweep_correct(const string &infile, const string &outfile, Timer &timer)
+{
+    TraceSpan span("sweep");
+    auto edges = sweep_values(sweep_edges, edge_reflectance, "--sweep-S list:   comma separated edge reflectances, e.g. .8,.85,.9\n");
+    auto gains = sweep_values(sweep_gains, corrector().gain(), "--sweep-gain list:   comma separated gain factors, e.g. 1,1.05,1.116\n");
+    float gamma = correct_image_in_aRGB ? 2.2f : 1.7f;
+    ArrayRGBT<T> image = TiffRead<T>(infile.c_str(), gamma);
+    if (image.nr == 0)
+        throw "Could not open input tif";
+    const Kernel &kernel = kernel_for(image.dpi);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+
+    Decimator decimator = corrector().decimator(kernel, image.nr, image.nc, image.dpi);
+    ArrayRGB image_reduced = decimator.decimate(image);
+    ArrayRGB margins = decimator.margin_response();
+    for (int color = 0; color < 3; color++)
+        for (size_t i = 0; i < image_reduced.v[color].size(); i++)
+            image_reduced.v[color][i] -= edge_reflectance * margins.v[color][i];
+    ArrayRGB image_light = corrector().reflected_light(image_reduced, kernel);
+    ArrayRGB margin_light = corrector().reflected_light(margins, kernel);
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+
+    const int rows = 256;
+    bool bits16 = force_ouput_bits == 16 ? true : force_ouput_bits == 8 ? false : image.from_16bits;
+    ArrayRGB correction = image_light;
+    for (auto &edge : edges)
+    {
+        for (int color = 0; color < 3; color++)
+            for (size_t i = 0; i < correction.v[color].size(); i++)
+                correction.v[color][i] = image_light.v[color][i] + edge.first * margin_light.v[color][i];
+        for (auto &gain : gains)
+        {
+            TraceSpan value_span("sweep value");
+            string file = sweep_file(outfile, edge.second, gain.second);
+            std::unique_ptr<TiffStripWriter> out;
+            if (!sweep_stats_only)
+                out = std::make_unique<TiffStripWriter>(file.c_str(), image.nr, image.nc, image.dpi, bits16, gamma,
+                    profile_name, image.profile, output_format());
+            CorrectionApplier applier(correction, image.dpi / kernel.refl_area.dpi, image.nc, simulate_reflected_light, gain.first);
+            double sums[3] = {};
+            size_t clipped = 0;
+            std::mutex m;
+            for (int first_row = 0; first_row < image.nr; first_row += rows)
+            {
+                int n = std::min(rows, image.nr - first_row);
+                ArrayRGBT<T> strip(n, image.nc, image.dpi, image.from_16bits, gamma);
+                size_t offset = size_t(first_row) * image.nc;
+                for (int color = 0; color < 3; color++)
+                    std::copy(image.v[color].begin() + offset, image.v[color].begin() + offset + strip.v[color].size(), strip.v[color].begin());
+                applier.apply(strip, first_row);
+                parallel_bands(n, [&](int color, int start_row, int end_row) {
+                    double sum = 0;
+                    size_t white = 0;
+                    for (size_t i = size_t(start_row) * strip.nc; i < size_t(end_row) * strip.nc; i++)
+                    {
+                        float x = to_float(strip.v[color][i]);
+                        sum += x;
+                        white += x >= 1;
+                    }
+                    std::lock_guard<std::mutex> lock(m);
+                    sums[color] += sum;
+                    clipped += white;
+                });
+                if (out)
+                    out->write(strip);
+            }
+            if (out)
+                out->close();
+            double samples = double(image.nr) * image.nc;
+            cout << "-S " << edge.first << " gain " << gain.first << ":  mean " << sums[0] / samples << " "
+                << sums[1] / samples << " " << sums[2] / samples << " (linear), " << 100 * clipped / (3 * samples)
+                << "% clipped white" << (out ? ", " + file : "") << endl;
+        }
+    }
+    if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+}
+
+// Input/output pairs from the command line, or from a manifest file with a pair per line.
+// Names containing spaces are quoted. Blank lines and lines starting with # are skipped.
+vector<std::pair<string, string>> batch_files(const vector<string> &args)
+{
+    vector<std::pair<string, string>> files;
+    if (args.size() == 1)
+    {
+        std::ifstream manifest(args[0]);
+        if (manifest.fail())
+            throw "-B:   could not open batch manifest\n";
+        string line;
+        while (std::getline(manifest, line))
+        {
+            std::istringstream fields(line);
+            string infile, outfile;
+            if (!(fields >> std::quoted(infile)) || infile[0] == '#')
+                continue;
+            if (!(fields >> std::quoted(outfile)))
+                throw "-B:   each manifest line needs an input and an output file\n";
+            files.emplace_back(infile, outfile);
+        }
+    }
+    else if (args.size() % 2 == 0)
+    {
+        for (size_t i = 0; i < args.size(); i += 2)
+            files.emplace_back(args[i], args[i + 1]);
+    }
+    if (files.empty())
+        throw "-B:   batch needs input/output file pairs or a manifest file\n";
+    return files;
+}
+
+// Corrects many files in one process. Kernels are built once per dpi, and while one file
+// is corrected the next is read and the previous written on their own threads, so up to
+// three images are in memory. With -M files are streamed one after another instead.
+// Files that fail are reported and skipped.
+template<class T>
+void batch_correct(const vector<std::pair<string, string>> &files, Timer &timer)
+{
+    using clock = std::chrono::steady_clock;
+    auto seconds = [](clock::time_point from) { return std::chrono::duration<double>(clock::now() - from).count(); };
+    float gamma = correct_image_in_aRGB ? 2.2f : 1.7f;
+    auto batch_start = clock::now();
+    vector<clock::time_point> started(files.size());
+    double total_mpixels = 0;
+    int failed = 0;
+    auto report = [&](size_t i, double mpixels) {
+        double secs = seconds(started[i]);
+        cout << files[i].first << " -> " << files[i].second << ":  " << mpixels << " Mpixels, "
+            << secs << " sec, " << mpixels / secs << " Mpixels/sec\n";
+        total_mpixels += mpixels;
+    };
+    auto fail = [&](size_t i, const char *e) {
+        cout << files[i].first << ":  " << e << endl;
+        failed++;
+    };
+
+    if (stream_rows != 0)
+    {
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            started[i] = clock::now();
+            try {
+                stream_correct(files[i].first, files[i].second, timer);
+                TiffStripReader in(files[i].first.c_str(), gamma);
+                report(i, double(in.nr) * in.nc / 1e6);
+            }
+            catch (const char *e) { fail(i, e); }
+            catch (const std::exception &e) { fail(i, e.what()); }
+        }
+    }
+    else
+    {
+        auto read = [&](size_t i) {
+            started[i] = clock::now();
+            return std::async(std::launch::async, [&files, i, gamma] { return TiffRead<T>(files[i].first.c_str(), gamma); });
+        };
+        std::future<ArrayRGBT<T>> reading = read(0);
+        std::future<void> writing;
+        size_t written = 0;
+        double written_mpixels = 0;
+        auto finish_write = [&]() {
+            if (!writing.valid())
+                return;
+            try {
+                writing.get();
+                report(written, written_mpixels);
+            }
+            catch (const char *e) { fail(written, e); }
+            catch (const std::exception &e) { fail(written, e.what()); }
+        };
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            ArrayRGBT<T> image;
+            string error;
+            try { image = reading.get(); }
+            catch (const char *e) { error = e; }
+            catch (const std::exception &e) { error = e.what(); }
+            if (error.empty() && image.nr == 0)
+                error = "Could not open input tif";     // TiffRead returns an empty image
+            // if the next read can't start, reading stays empty and that file fails on get()
+            if (i + 1 < files.size())
+                try { reading = read(i + 1); }
+                catch (const std::system_error &) {}
+            if (!error.empty())
+            {
+                fail(i, error.c_str());
+                continue;
+            }
+            try { correct_image(image, timer); }
+            catch (const char *e) { fail(i, e); continue; }
+            catch (const std::exception &e) { fail(i, e.what()); continue; }
+            finish_write();
+            written = i;
+            written_mpixels = double(image.nr) * image.nc / 1e6;
+            try {
+                writing = std::async(std::launch::async, [&files, i, image = std::move(image)]() mutable {
+                    write_output(files[i].second, image);
+                });
+            }
+            catch (const std::system_error &e) { fail(i, e.what()); }
+        }
+        finish_write();
+    }
+    double secs = seconds(batch_start);
+    cout << files.size() - failed << " of " << files.size() << " files, " << total_mpixels << " Mpixels in "
+        << secs << " sec, " << total_mpixels / secs << " Mpixels/sec\n";
+}
+
+// Copies a strip of combined rows into the full image starting at first_row
+template<class T>
+void store_rows(ArrayRGBT<T> &image, const ArrayRGB &strip, int first_row)
+{
+    size_t offset = size_t(first_row) * image.nc;
+    for (int color = 0; color < 3; color++)
+    {
+        if constexpr (std::is_same<T, float>::value)
+            std::copy(strip.v[color].begin(), strip.v[color].end(), image.v[color].begin() + offset);
+        else
+            narrow(strip.v[color].data(), image.v[color].data() + offset, (int)strip.v[color].size());
+    }
+}
+
+// Main's in memory processing: read the input file, or combine several with -z, correct
+// and write the result. Several inputs are read a strip at a time and with -Z the combined
+// strips go straight to the output file, so memory is the inputs times the strip height.
+template<class T>
+void correct_files(const vector<string> &cmdArgs, Timer &timer)
+{
+    int argCnt=(int)cmdArgs.size();
+    float gamma = correct_image_in_aRGB ? 2.2f : 1.7f;
+    ArrayRGBT<T> image_in;
+    if (argCnt - 3 > 0)
+    {
+        StripAverager in(vector<string>(cmdArgs.begin() + 1, cmdArgs.end() - 1), gamma, average_mode(average_stat));
+        int rows = stream_rows != 0 ? stream_rows : 64;
+        if (average_files_only)
+        {
+            cout << "Averaging " << argCnt - 2 << " files into " << cmdArgs[argCnt-1].c_str() << "\n";
+            bool bits16 = force_ouput_bits == 16 ? true : force_ouput_bits == 8 ? false : in.from_16bits;
+            TiffStripWriter out(cmdArgs[argCnt-1].c_str(), in.nr, in.nc, in.dpi, bits16, gamma, profile_name, in.profile,
+                output_format());
+            while (in.row < in.nr)
+                out.write(in.read(rows));
+            out.close();
+            if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+            return;
+        }
+        image_in = ArrayRGBT<T>(in.nr, in.nc, in.dpi, in.from_16bits, gamma);
+        image_in.profile = in.profile;
+        while (in.row < in.nr)
+        {
+            int first_row = in.row;
+            store_rows(image_in, in.read(rows), first_row);
+        }
+    }
+    else
+        image_in = TiffRead<T>(cmdArgs[1].c_str(), gamma);
+
+    if (!average_files_only)
+        correct_image(image_in, timer);
+		if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+    write_output(cmdArgs[argCnt-1], image_in);
+		if (print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+}
+
+int main(int argc, char const **argv)
+{
+    Timer timer;
+    vector<string> cmdArgs = vectorize_commands(argc, argv);
+    vector<std::pair<string, string>> batch;
+
+    // process options, all options must be valid and at least one file argument remaining
+    try
+    {
+        procFlag("-A", cmdArgs, correct_image_in_aRGB);
+        procFlag("-S", cmdArgs, edge_reflectance);
+        procFlag("-W", cmdArgs, adjust_to_detected_white);
+        procFlag("-P", cmdArgs, profile_name);
+        procFlag("-R", cmdArgs, simulate_reflected_light);
+        procFlag("-I", cmdArgs, save_intermediate_files);
+        procFlag("-N", cmdArgs, no_gain_restore);
+		procFlag("-F", cmdArgs, force_ouput_bits);
+		procFlag("-T", cmdArgs, print_line_and_time);
+        procFlag("-Z", cmdArgs, average_files_only);
+        procFlag("-C", cmdArgs, convolve_engine);
+        procFlag("-E", cmdArgs, svd_max_error);
+        procFlag("-j", cmdArgs, thread_count);
+        procFlag("-M", cmdArgs, stream_rows);
+        procFlag("-O", cmdArgs, output_compression);
+        procFlag("-B", cmdArgs, batch_mode);
+        procFlag("-K", cmdArgs, kernel_cache_dir);
+        procFlag("-H", cmdArgs, pixel_storage);
+        procFlag("-z", cmdArgs, average_stat);
+        procFlag("-J", cmdArgs, trace_file);
+        procFlag("--roi", cmdArgs, roi_spec);
+        procFlag("--preview", cmdArgs, preview_width);
+        procFlag("--tile", cmdArgs, tile_size);
+        procFlag("--scratch-dir", cmdArgs, scratch_dir);
+        procFlag("--sweep-S", cmdArgs, sweep_edges);
+        procFlag("--sweep-gain", cmdArgs, sweep_gains);
+        procFlag("--sweep-stats", cmdArgs, sweep_stats_only);
+        convolve_mode(convolve_engine);     // validate
+        tiff_compression(output_compression);
+        storage_type(pixel_storage);
+        average_mode(average_stat);
+
+		if (cmdArgs.size() == 1)
+            throw("command line error\n");
+        if (force_ouput_bits!=0 && force_ouput_bits!=8 && force_ouput_bits!=16)
+            throw("-F n:   n must be either 8 or 16\n");
+        if (thread_count < 0)
+            throw("-j n:   n must be 0 (all cores) or more\n");
+        set_thread_count(thread_count);
+        if (stream_rows < 0)
+            throw("-M n:   n must be 1 or more rows\n");
+        if (stream_rows != 0 && !average_files_only && (adjust_to_detected_white || (cmdArgs.size() != 3 && !batch_mode)))
+            throw("-M n:   streaming corrects one input file, without -W\n");
+        if (batch_mode && average_files_only)
+            throw("-B:   batch mode corrects files, it can't be used with -Z\n");
+        if (roi_spec != "")
+            parse_roi(roi_spec);        // validate
+        if (tile_size < 0 || tile_size % 16 != 0)
+            throw("--tile n:   n must be a multiple of 16, 256 is typical\n");
+        if (preview_width < 0)
+            throw("--preview width:   width must be 1 or more pixels\n");
+        if ((roi_spec != "" || preview_width != 0) && ((roi_spec != "" && preview_width != 0) || batch_mode || average_files_only
+            || adjust_to_detected_white || cmdArgs.size() != 3))
+            throw("--roi, --preview:   one of them, for one input file, without -B, -W or -Z\n");
+        if ((sweep_edges != "" || sweep_gains != "" || sweep_stats_only) && (roi_spec != "" || preview_width != 0
+            || batch_mode || average_files_only || adjust_to_detected_white || stream_rows != 0 || cmdArgs.size() != 3))
+            throw("--sweep-S, --sweep-gain:   for one input file, without -B, -M, -W, -Z, --roi or --preview\n");
+        set_scratch_dir(scratch_dir);
+        if (trace_file != "")
+            trace_start(trace_file);
+        if (batch_mode)
+            batch = batch_files(vector<string>(cmdArgs.begin() + 1, cmdArgs.end()));
+    }
+    catch (const char *e)
+    {
+        cout << e << endl;
+        cout << "Version 1.1:\n"
+            "Usage: scannerreflfix [ zero or more options] infile.tif outfile.tif\n" <<
+            "  -A                   Correct Image Already in Adobe RGB\n" <<
+            "  -F 8|16              Force 8 or 16 bit tif output]\n" <<
+            "  -W                   Maximize white (Like Relative Col with tint retention)\n" <<
+            "  -P profile           Attach profile <profile.icc>\n" <<
+            "  -S edge_refl         ave refl outside of scanned area (0 to 1, default: .85)\n" <<
+            "  -C engine            Reflection convolution: direct, fft, svd or multires (default: direct)\n" <<
+            "  -E max_err           -C svd max error in reflected light (default: .0001)\n" <<
+            "  -j n                 Worker threads (default: 0, one per core)\n" <<
+            "  -M n                 Stream large images in strips of n rows (limits memory)\n" <<
+            "  -z mean|median|clip[:sigma]  Combine several input files per pixel (default: mean)\n" <<
+            "  -O comp              Output compression none|lzw|zip[:1-9]|zstd[:1-22] (default: none)\n" <<
+            "  -B                   Batch: files are in.tif out.tif pairs or one manifest file of pairs\n" <<
+            "  -K dir               Cache reflection kernels in directory dir\n" <<
+            "  -H float|half|uint16 Full resolution image storage, half and uint16 use half the memory\n" <<
+            "  -J trace.json        Write per stage and per thread times, bytes and peak memory (Chrome trace)\n" <<
+            "  --roi x,y,w,h        Correct and write only this rectangle (pixels), reflections from the whole scan\n" <<
+            "  --preview width      Write a width pixel wide corrected preview without a full resolution pass\n" <<
+            "  --tile n             Write tiled tifs with n x n pixel tiles (multiple of 16)\n" <<
+            "  --scratch-dir dir    Keep large images in memory mapped files in dir instead of memory\n" <<
+            "  --sweep-S list       Write out_S<value>.tif for each of a comma separated list of -S values\n" <<
+            "  --sweep-gain list    Same for gain restore factors (default: 1.116), with --sweep-S all pairs\n" <<
+            "  --sweep-stats        Print each sweep output's mean and clipped whites instead of writing it\n\n" <<
+			"                       Test options\n" <<
+			"  -I                   Save intermediate files\n" <<
+			"  -T                   Show line numbers and accumulated time.\n" <<
+			"  -N                   Don't Restore gain after subtracting reflection (Diagnostic only)\n" <<
+			"  -R                   Simulated scanner by adding reflected light\n" <<
+            "  -Z                   Average multiple input files with No Refl. Correction.\n" <<
+            "                       -z selects the average, -M n the rows read from each file at a time\n\n" <<
+            "scannerreflfix.exe models and removes re-reflected light from an area\n"
+			"approx 1\" around scanned RGB values for the Epson V850 scanner.\n";
+            exit(0);
+    }
+
+    // Create an image with simulated reflected light added from standard tif image
+    // useful for simulating the effect of the re-reflected scanner light
+    if (simulate_reflected_light) {
+        cout <<"Simulating reflected light for V800/V850\n";
+    }
+    else if (!average_files_only)
+        cout <<"Correcting reflected light for V800/V850\n";
+    else
+        cout << "No File Processing\n";
+    try {
+        if (batch_mode)
+        {
+            switch (storage_type(pixel_storage))
+            {
+            case Storage::float16:
+                batch_correct<half>(batch, timer);
+                break;
+            case Storage::uint16:
+                batch_correct<uint16>(batch, timer);
+                break;
+            default:
+                batch_correct<float>(batch, timer);
+            }
+        }
+        else if (roi_spec != "")
+            roi_correct(cmdArgs[1], cmdArgs[2], parse_roi(roi_spec), timer);
+        else if (preview_width != 0)
+            preview_correct(cmdArgs[1], cmdArgs[2], preview_width, timer);
+        else if (sweep_edges != "" || sweep_gains != "" || sweep_stats_only)
+        {
+            switch (storage_type(pixel_storage))
+            {
+            case Storage::float16:
+                sweep_correct<half>(cmdArgs[1], cmdArgs[2], timer);
+                break;
+            case Storage::uint16:
+                sweep_correct<uint16>(cmdArgs[1], cmdArgs[2], timer);
+                break;
+            default:
+                sweep_correct<float>(cmdArgs[1], cmdArgs[2], timer);
+            }
+        }
+        else if (stream_rows != 0 && !average_files_only)
+            stream_correct(cmdArgs[1], cmdArgs[2], timer);
+        else
+        {
+            switch (storage_type(pixel_storage))
+            {
+            case Storage::float16:
+                correct_files<half>(cmdArgs, timer);
+                break;
+            case Storage::uint16:
+                correct_files<uint16>(cmdArgs, timer);
+                break;
+            default:
+                correct_files<float>(cmdArgs, timer);
+            }
+        }
+    }
+    catch (const char *e)
+    {
+        cout << e << "\nPress enter to exit\n";
+        char tmp[10];
+        cin.getline(tmp, 1);
+    }
+    catch (const std::exception &e)
+    {
+        cout << e.what() << endl;
+    }
+    catch (...) {
+        cout << "unknown exception\n";
+    }
+
+    if (print_line_and_time)
+    {
+        for (auto &stage : allocation_stats())
+            cout << "allocations in " << (stage.first.empty() ? "other" : stage.first) << ": " << stage.second.count << ", "
+                << stage.second.bytes / 1e6 << " MB, " << stage.second.reused << " reused" << endl;
+    }
+    release_pool();
+
+    // written for failed runs too, the spans up to the failure are still useful
+    try {
+        trace_finish();
+    }
+    catch (const char *e) {
+        cout << e << endl;
+    }
+}
+
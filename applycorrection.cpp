@@ -0,0 +1,222 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "applycorrection.h"
+#include "trace.h"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define APPLY_SSE2
+#endif
+
+
+CorrectionApplier::CorrectionApplier(const ArrayRGB &correction, int reduction, int nc, bool simulate, float gain, int first_col)
+    : correction(correction), reduction(reduction), nc(nc), sign(simulate ? 1.f : -1.f), gain(gain),
+      c0(nc), c1(nc), w0(nc), w1(nc)
+{
+    for (int i = 0; i < nc; i++)
+    {
+        int c = first_col + i;
+        c0[i] = c / reduction;
+        c1[i] = std::min(c / reduction + 1, correction.nc - 1);
+        w1[i] = static_cast<float>(c%reduction) / reduction;
+        w0[i] = 1 - w1[i];
+    }
+}
+
+void CorrectionApplier::upsample_row(int r, int color, float *line, float *up) const
+{
+    int r0 = r / reduction;
+    int r1 = std::min(r / reduction + 1, correction.nr - 1);
+    float dr = static_cast<float>(r%reduction) / reduction;
+    // interpolate between correction rows once, then across columns per output pixel
+    const float *q0 = &correction(r0, 0, color);
+    const float *q1 = &correction(r1, 0, color);
+    for (int c = 0; c < correction.nc; c++)
+        line[c] = q0[c] * (1 - dr) + q1[c] * dr;
+    for (int c = 0; c < nc; c++)
+        up[c] = line[c0[c]] * w0[c] + line[c1[c]] * w1[c];
+}
+
+void apply_row(float *image, const float *up, int n, float sign, float gain)
+{
+    int c = 0;
+#if defined(__AVX2__)
+    const __m256 vsign = _mm256_set1_ps(sign), vgain = _mm256_set1_ps(gain);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    for (; c + 8 <= n; c += 8)
+    {
+        __m256 x = _mm256_loadu_ps(image + c);
+        __m256 t = _mm256_mul_ps(_mm256_loadu_ps(up + c), x);
+        t = _mm256_mul_ps(_mm256_add_ps(x, _mm256_mul_ps(vsign, t)), vgain);
+        _mm256_storeu_ps(image + c, _mm256_min_ps(_mm256_max_ps(t, zero), one));
+    }
+#elif defined(APPLY_SSE2)
+    const __m128 vsign = _mm_set1_ps(sign), vgain = _mm_set1_ps(gain);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+    for (; c + 4 <= n; c += 4)
+    {
+        __m128 x = _mm_loadu_ps(image + c);
+        __m128 t = _mm_mul_ps(_mm_loadu_ps(up + c), x);
+        t = _mm_mul_ps(_mm_add_ps(x, _mm_mul_ps(vsign, t)), vgain);
+        _mm_storeu_ps(image + c, _mm_min_ps(_mm_max_ps(t, zero), one));
+    }
+#endif
+    for (; c < n; c++)
+    {
+        float t = (image[c] + sign * (up[c] * image[c])) * gain;
+        image[c] = std::clamp(t, 0.f, 1.f);
+    }
+}
+
+// Rows stored as uint16 or half are widened to float, corrected and narrowed back
+template<class T>
+void CorrectionApplier::apply(ArrayRGBT<T> &image, int first_row, SampleHistogram *histogram) const
+{
+    assert(image.nc == nc);
+    TraceSpan span("apply", 3.0 * sizeof(T) * image.v[0].size());
+    parallel_bands(image.nr, [&](int color, int start_row, int end_row) {
+        vector<float> line(correction.nc), up(nc);
+        vector<float> wide(std::is_same_v<T, float> ? 0 : nc);
+        vector<uint32_t> local(histogram ? SampleHistogram::bins : 0);
+        for (int i = start_row; i < end_row; i++)
+        {
+            upsample_row(i + first_row, color, line.data(), up.data());
+            if constexpr (std::is_same_v<T, float>)
+                apply_row(&image(i, 0, color), up.data(), nc, sign, gain);
+            else
+            {
+                widen(&image(i, 0, color), wide.data(), nc);
+                apply_row(wide.data(), up.data(), nc, sign, gain);
+                narrow(wide.data(), &image(i, 0, color), nc);
+            }
+            if (histogram)
+                SampleHistogram::count(&image(i, 0, color), nc, local.data());
+        }
+        if (histogram)
+            histogram->merge(local.data(), color);
+    });
+}
+template void CorrectionApplier::apply(ArrayRGBT<float> &, int, SampleHistogram *) const;
+template void CorrectionApplier::apply(ArrayRGBT<uint16> &, int, SampleHistogram *) const;
+template void CorrectionApplier::apply(ArrayRGBT<half> &, int, SampleHistogram *) const;
+
+
+// Bin of a sample, non decreasing in its value
+static inline int sample_bin(float x) { return x >= 1 ? 65535 : x > 0 ? static_cast<int>(x * 65535) : 0; }
+static inline int sample_bin(uint16_t x) { return x; }
+static inline int sample_bin(half x) { return x.bits & 0x8000 ? 0 : x.bits; }
+
+template<class T>
+void SampleHistogram::count(const T *x, int n, uint32_t *local)
+{
+    for (int c = 0; c < n; c++)
+        local[sample_bin(x[c])]++;
+}
+
+void SampleHistogram::merge(const uint32_t *local, int color)
+{
+    std::lock_guard<std::mutex> lock(m);
+    for (int bin = 0; bin < bins; bin++)
+        counts[color][bin] += local[bin];
+}
+
+// Unsigned keys in the order of the float values: positive floats with the sign bit set,
+// negative floats with all bits flipped
+static inline uint32_t order_key(float x)
+{
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits & 0x80000000u ? ~bits : bits | 0x80000000u;
+}
+
+static inline float from_order_key(uint32_t key)
+{
+    uint32_t bits = key & 0x80000000u ? key & 0x7fffffffu : ~key;
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+template<class T>
+float SampleHistogram::select(const ArrayRGBT<T> &image, int color, size_t k) const
+{
+    const vector<uint64_t> &count = counts[color];
+    assert(k < std::accumulate(count.begin(), count.end(), uint64_t(0)));
+    int bin = 0;
+    size_t below = 0;          // samples in bins under bin
+    while (below + count[bin] <= k)
+        below += count[bin++];
+    if constexpr (std::is_same_v<T, uint16>)
+        return to_float(static_cast<uint16>(bin));
+    else
+    {
+        if constexpr (std::is_same_v<T, half>)
+            if (bin != 0)
+                return to_float(half{ static_cast<uint16_t>(bin) });
+        if (bin == bins - 1)
+            return 1.0f;        // float samples at 1 and over, apply() clamps them to 1
+        // The bin holds several values. Find the one at k among its samples by their
+        // order keys, the top 16 bits in one pass then the low 16 bits of the samples
+        // with that top in another, each pass counting into a fixed size histogram.
+        size_t rank = k - below;
+        uint32_t top = 0;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            vector<uint64_t> sub(bins);
+            std::mutex m;
+            parallel_bands(image.nr, [&](int, int start_row, int end_row) {
+                vector<uint32_t> local(bins);
+                for (size_t p = size_t(start_row) * image.nc; p < size_t(end_row) * image.nc; p++)
+                {
+                    if (sample_bin(image.v[color][p]) != bin)
+                        continue;
+                    uint32_t key = order_key(to_float(image.v[color][p]));
+                    if (pass == 0)
+                        local[key >> 16]++;
+                    else if (key >> 16 == top)
+                        local[key & 0xffff]++;
+                }
+                std::lock_guard<std::mutex> lock(m);
+                for (int i = 0; i < bins; i++)
+                    sub[i] += local[i];
+            }, 1);
+            uint32_t part = 0;
+            while (sub[part] <= rank)
+                rank -= sub[part++];
+            if (pass == 0)
+                top = part;
+            else
+                return from_order_key(top << 16 | part);
+        }
+        return 0;       // not reached
+    }
+}
+template float SampleHistogram::select(const ArrayRGBT<float> &, int, size_t) const;
+template float SampleHistogram::select(const ArrayRGBT<uint16> &, int, size_t) const;
+template float SampleHistogram::select(const ArrayRGBT<half> &, int, size_t) const;
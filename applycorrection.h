@@ -0,0 +1,75 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef APPLYCORRECTION_H
+#define APPLYCORRECTION_H
+
+#include "tiffresults.h"
+#include <cstdint>
+#include <mutex>
+
+// Per color counts of a full resolution image's samples for -W, filled during the apply
+// pass. Samples are counted in 65536 bins that preserve their order: the value itself for
+// uint16, the bit pattern for (non negative) half, x*65535 truncated for float. select()
+// then finds the exact k-th smallest sample without sorting or copying the image.
+class SampleHistogram {
+public:
+    static constexpr int bins = 65536;
+    SampleHistogram() { for (auto &c : counts) c.resize(bins); }
+    template<class T> static void count(const T *x, int n, uint32_t *local);   // add n samples to local
+    void merge(const uint32_t *local, int color);                               // thread safe
+    // k-th smallest (0 based) sample of color. Only float, or half in the bottom bin,
+    // rescans the image, twice, with a fixed size histogram of the winning bin's samples.
+    template<class T> float select(const ArrayRGBT<T> &image, int color, size_t k) const;
+private:
+    vector<uint64_t> counts[3];
+    std::mutex m;
+};
+
+// Applies the reduced resolution reflected light estimate to full resolution rows.
+// Same bilinear interpolation as bilinear(), but the column indices and weights are
+// computed once, each full resolution row of the correction is built in a buffer, and
+// the subtract (or add when simulating), gain and clamp run as contiguous SIMD loops
+// (AVX2 or SSE2 when the compiler targets them) over row bands on the thread pool.
+class CorrectionApplier {
+public:
+    // gain multiplies the result: .876/.785 to restore gain, 1 for -N, .785/.876 for -R
+    // Images are columns [first_col, first_col + nc) of the full resolution image.
+    CorrectionApplier(const ArrayRGB &correction, int reduction, int nc, bool simulate, float gain, int first_col = 0);
+    // image holds full resolution rows [first_row, first_row + image.nr)
+    // If histogram isn't null the corrected samples are also counted in it.
+    template<class T> void apply(ArrayRGBT<T> &image, int first_row, SampleHistogram *histogram = nullptr) const;
+    void upsample_row(int r, int color, float *line, float *up) const;    // full resolution correction row, line is correction.nc scratch
+private:
+    const ArrayRGB &correction;
+    int reduction;
+    int nc;
+    float sign;                     // -1 removes reflected light, +1 adds it
+    float gain;
+    vector<int> c0, c1;             // correction columns each side of a full res column
+    vector<float> w0, w1;           // and their weights
+};
+
+// image = clamp((image + sign*up*image) * gain, 0, 1) over n values
+void apply_row(float *image, const float *up, int n, float sign, float gain);
+
+#endif
@@ -0,0 +1,214 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+// Times each stage of the correction on synthetic scans at 300, 600, 1200 and 2400 dpi.
+//   stagebench [-d dpi] [-i inches] [-r reps] [-j threads]
+// -d runs a single dpi, -i is the scan width (height is 1.25x, default 2), -r keeps the
+// best of reps runs (default 3), -j is as in scannerreflfix.
+// MPix/s counts the pixels of the image the stage works on: the full resolution scan
+// for I/O, downsampling and apply, the reduced image for the convolutions and the
+// kernel for getReflArea. bytes/pixel is the stage's input plus output data per such
+// pixel (file bytes for I/O), so the two multiplied are its effective bandwidth.
+
+#include "ArgumentParse.h"
+#include "tiffresults.h"
+#include "reflconvolve.h"
+#include "applycorrection.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+using std::cout;
+
+int reps = 3;
+
+// Best time in seconds of reps calls of f, each after an untimed call of setup
+template<class S, class F>
+double best_time(S setup, F f)
+{
+    double best = 1e30;
+    for (int i = 0; i < reps; i++)
+    {
+        setup();
+        Timer timer;
+        f();
+        best = std::min(best, timer.stop());
+    }
+    return best;
+}
+
+template<class F>
+double best_time(F f)
+{
+    return best_time([] {}, f);
+}
+
+void report(const char *stage, int dpi, double pixels, double bytes_per_pixel, double secs)
+{
+    cout << std::left << std::setw(26) << stage << std::right << std::setw(6) << dpi
+        << std::fixed << std::setprecision(2) << std::setw(10) << pixels / 1e6
+        << std::setw(10) << secs * 1e3
+        << std::setw(10) << pixels / 1e6 / secs
+        << std::setw(10) << bytes_per_pixel << "\n";
+}
+
+// Smooth shading plus a fine texture so compression and the convolution see scan-like data
+ArrayRGB synthetic_scan(int nr, int nc, int dpi)
+{
+    ArrayRGB image(nr, nc, dpi);
+    parallel_bands(nr, [&](int color, int start_row, int end_row) {
+        for (int r = start_row; r < end_row; r++)
+            for (int c = 0; c < nc; c++)
+            {
+                float shade = .15f + .7f * (r + c * (color + 1) % nc) / float(nr + nc);
+                float texture = .05f * ((r * 7 + c * 13 + color * 5) % 17) / 17;
+                image(r, c, color) = shade + texture;
+            }
+    });
+    return image;
+}
+
+double file_size(const char *file)
+{
+    std::ifstream f(file, std::ios::binary | std::ios::ate);
+    return static_cast<double>(f.tellg());
+}
+
+void bench_dpi(int dpi, float inches)
+{
+    const char *tmp = "stagebench.tif";
+    int nc = static_cast<int>(inches * dpi);
+    int nr = static_cast<int>(inches * 1.25f * dpi);
+    double pixels = double(nr) * nc;
+    ArrayRGB image = synthetic_scan(nr, nc, dpi);
+
+    for (bool bits16 : { false, true })
+    {
+        image.from_16bits = bits16;
+        double secs = best_time([&] { TiffWrite(tmp, image, ""); });
+        double bytes = file_size(tmp) / pixels;
+        report(bits16 ? "TiffWrite 16 bit" : "TiffWrite 8 bit", dpi, pixels, bytes + 12, secs);
+        secs = best_time([&] { ArrayRGB in = TiffRead(tmp, image.gamma); });
+        report(bits16 ? "TiffRead 16 bit" : "TiffRead 8 bit", dpi, pixels, bytes + 12, secs);
+    }
+    std::remove(tmp);
+
+    double secs = best_time([&] { ArrayRGB half_size = downsample(image, 2); });
+    report("downsample x2", dpi, pixels, 12 + 12. / 4, secs);
+
+    int x2, x3;
+    reduced_refl_dpi(dpi, x2, x3);
+    ArrayRGB refl_area;
+    secs = best_time([&] { refl_area = std::get<0>(getReflArea(dpi)); });
+    double kernel_pixels = double(refl_area.nr) * refl_area.nc;
+    report("getReflArea", dpi, kernel_pixels, 12, secs);
+
+    vector<int> rates(x3, 3);
+    rates.insert(rates.end(), x2, 2);
+    Decimator decimator(nr, nc, dpi, rates, dpi, .85f);
+    ArrayRGB image_reduced;
+    secs = best_time([&] { image_reduced = decimator.decimate(image); });
+    double reduced_pixels = double(image_reduced.nr) * image_reduced.nc;
+    report("Decimator (to kernel dpi)", dpi, pixels, 12 + 12 * reduced_pixels / pixels, secs);
+
+    ArrayRGB correction;
+    secs = best_time([&] { correction = generate_reflected_light_estimate(image_reduced, refl_area); });
+    report("convolve direct", dpi, reduced_pixels, 24 + 12 * kernel_pixels / reduced_pixels, secs);
+    KernelSpectrum spectrum = kernel_spectrum(refl_area);
+    secs = best_time([&] { correction = generate_reflected_light_estimate(image_reduced, spectrum); });
+    report("convolve fft", dpi, reduced_pixels, 24, secs);
+    SeparableKernel separable = separable_kernel(refl_area, .0001);
+    secs = best_time([&] { correction = generate_reflected_light_estimate(image_reduced, separable); });
+    report("convolve svd", dpi, reduced_pixels, 24, secs);
+    // at one reduction step finer, as ReflectionCorrector builds it for -C multires. Counted
+    // in pixels at the usual kernel dpi so MPix/s compares with the other engines.
+    int rate = x2 > 0 ? 2 : x3 > 0 ? 3 : 1;
+    vector<int> fine_rates(rates.begin(), rates.end() - (rate > 1));
+    ArrayRGB fine_reduced = Decimator(nr, nc, dpi, fine_rates, dpi, .85f).decimate(image);
+    MultiresKernel multires = multires_kernel(std::get<0>(getReflArea(dpi, refl_area.dpi * rate)), 2 * rate);
+    secs = best_time([&] { ArrayRGB fine_correction = generate_reflected_light_estimate(fine_reduced, multires); });
+    double fine_pixels = double(fine_reduced.nr) * fine_reduced.nc;
+    report("convolve multires", dpi, reduced_pixels, 24 * fine_pixels / reduced_pixels, secs);
+
+    CorrectionApplier applier(correction, dpi / refl_area.dpi, nc, false, .876f / .785f);
+    // every rep corrects a fresh copy of the scan, not the previous rep's output
+    ArrayRGB scan;
+    secs = best_time([&] { scan = image; }, [&] { applier.apply(scan, 0); });
+    report("apply", dpi, pixels, 24, secs);
+    // the per pixel bilinear() loop CorrectionApplier replaced, for comparison
+    int reduction = dpi / refl_area.dpi;
+    secs = best_time([&] { scan = image; }, [&] {
+        for (int color = 0; color < 3; color++)
+            for (int i = 0; i < scan.nr; i++)
+                for (int ii = 0; ii < scan.nc; ii++)
+                {
+                    float tmp = scan(i, ii, color) - bilinear(correction, i, ii, reduction, color) * scan(i, ii, color);
+                    scan(i, ii, color) = std::clamp(tmp * (.876f / .785f), 0.f, 1.f);
+                }
+    });
+    report("apply (per pixel bilinear)", dpi, pixels, 24, secs);
+}
+
+int main(int argc, char const **argv)
+{
+    vector<string> cmdArgs = vectorize_commands(argc, argv);
+    int dpi = 0;
+    float inches = 2;
+    int thread_count = 0;
+    try
+    {
+        procFlag("-d", cmdArgs, dpi);
+        procFlag("-i", cmdArgs, inches);
+        procFlag("-r", cmdArgs, reps);
+        procFlag("-j", cmdArgs, thread_count);
+        if (cmdArgs.size() != 1 || reps < 1 || thread_count < 0 || !(inches > 0))
+            throw "command line error\n";
+        if (dpi != 0 && dpi != 300 && dpi != 600 && dpi != 1200 && dpi != 2400)
+            throw "-d dpi:   dpi must be 300, 600, 1200 or 2400\n";
+    }
+    catch (const char *e)
+    {
+        cout << e << "Usage: stagebench [-d dpi] [-i inches] [-r reps] [-j threads]\n";
+        return 1;
+    }
+    set_thread_count(thread_count);
+
+    cout << std::left << std::setw(26) << "stage" << std::right << std::setw(6) << "dpi"
+        << std::setw(10) << "Mpix" << std::setw(10) << "ms" << std::setw(10) << "MPix/s"
+        << std::setw(10) << "bytes/pix" << "\n";
+    try
+    {
+        for (int d : { 300, 600, 1200, 2400 })
+            if (dpi == 0 || d == dpi)
+                bench_dpi(d, inches);
+    }
+    catch (const char *e)
+    {
+        cout << e << "\n";
+        return 1;
+    }
+    return 0;
+}
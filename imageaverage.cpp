@@ -0,0 +1,178 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "imageaverage.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+#include <cmath>
+
+AverageMode average_mode(const string &name)
+{
+    AverageMode mode;
+    auto colon = name.find(':');
+    string stat = name.substr(0, colon);
+    if (stat == "mean" && colon == string::npos)
+        mode.stat = AverageStat::mean;
+    else if (stat == "median" && colon == string::npos)
+        mode.stat = AverageStat::median;
+    else if (stat == "clip")
+    {
+        mode.stat = AverageStat::clip;
+        if (colon != string::npos)
+        {
+            try {
+                mode.sigma = std::stof(name.substr(colon + 1));
+            }
+            catch (...) {
+                mode.sigma = 0;
+            }
+        }
+        if (!(mode.sigma > 0))
+            throw "-z stat:   clip sigma must be more than 0\n";
+    }
+    else
+        throw "-z stat:   stat must be mean, median or clip[:sigma]\n";
+    return mode;
+}
+
+float combine_mean(const float *x, int n)
+{
+    float sum = x[0];
+    for (int i = 1; i < n; i++)
+        sum += x[i];
+    return sum / n;
+}
+
+float combine_median(float *x, int n)
+{
+    std::nth_element(x, x + n / 2, x + n);
+    float upper = x[n / 2];
+    if (n % 2)
+        return upper;
+    float lower = *std::max_element(x, x + n / 2);
+    return (lower + upper) / 2;
+}
+
+// Iterated until no more values are dropped. The median is the center so a single dust
+// speck or dropout can't drag it, the spread is the std dev of the values still kept.
+float combine_clipped(float *x, int n, float sigma)
+{
+    int kept = n;
+    while (kept > 2)
+    {
+        float center = combine_median(x, kept);
+        double sum = 0, sum2 = 0;
+        for (int i = 0; i < kept; i++)
+        {
+            sum += x[i];
+            sum2 += double(x[i]) * x[i];
+        }
+        double mean = sum / kept;
+        float limit = sigma * static_cast<float>(std::sqrt(std::max(0.0, sum2 / kept - mean * mean)));
+        auto end = std::partition(x, x + kept, [&](float v) { return std::fabs(v - center) <= limit; });
+        if (end - x == kept || end == x)
+            break;
+        kept = static_cast<int>(end - x);
+    }
+    double sum = 0;
+    for (int i = 0; i < kept; i++)
+        sum += x[i];
+    return static_cast<float>(sum / kept);
+}
+
+StripAverager::StripAverager(const vector<string> &files, float gamma, const AverageMode &mode)
+    : gamma(gamma), mode(mode)
+{
+    for (auto &file : files)
+    {
+        if (TiffStripReader::can_read(file.c_str()))
+        {
+            in.push_back(std::make_unique<TiffStripReader>(file.c_str(), gamma));
+            whole.emplace_back();
+        }
+        else
+        {
+            in.emplace_back();
+            whole.push_back(TiffRead(file.c_str(), gamma));
+            if (whole.back().nr == 0)
+                throw "Could not open input tif";     // TiffRead returns an empty image
+        }
+        int file_nr = in.back() ? in.back()->nr : whole.back().nr;
+        int file_nc = in.back() ? in.back()->nc : whole.back().nc;
+        if (in.size() == 1)
+        {
+            nr = file_nr;
+            nc = file_nc;
+            dpi = in[0] ? in[0]->dpi : whole[0].dpi;
+            from_16bits = in[0] ? in[0]->from_16bits : whole[0].from_16bits;
+            profile = in[0] ? in[0]->profile : whole[0].profile;
+        }
+        else if (file_nr != nr || file_nc != nc)
+            throw "Additional input images are not the same size";
+    }
+}
+
+ArrayRGB StripAverager::read(int nrows)
+{
+    nrows = std::min(nrows, nr - row);
+    int n = static_cast<int>(in.size());
+    TraceSpan span("combine", 12.0 * nrows * nc * n);
+    vector<ArrayRGB> strips(n);
+    thread_pool().parallel_for(n, [&](int i) {
+        if (in[i])
+            strips[i] = in[i]->read(nrows);
+        else
+        {
+            strips[i] = ArrayRGB(nrows, nc);
+            size_t offset = size_t(row) * nc;
+            for (int color = 0; color < 3; color++)
+                std::copy(whole[i].v[color].begin() + offset, whole[i].v[color].begin() + offset + strips[i].v[color].size(),
+                    strips[i].v[color].begin());
+        }
+    });
+    row += nrows;
+
+    ArrayRGB rgb(nrows, nc, dpi, from_16bits, gamma);
+    rgb.profile = profile;
+    parallel_bands(nrows, [&](int color, int r0, int r1) {
+        vector<float> x(n);
+        for (size_t p = size_t(r0) * nc; p < size_t(r1) * nc; p++)
+        {
+            for (int i = 0; i < n; i++)
+                x[i] = strips[i].v[color][p];
+            switch (mode.stat)
+            {
+            case AverageStat::median:
+                rgb.v[color][p] = combine_median(x.data(), n);
+                break;
+            case AverageStat::clip:
+                rgb.v[color][p] = combine_clipped(x.data(), n, mode.sigma);
+                break;
+            default:
+                rgb.v[color][p] = combine_mean(x.data(), n);
+            }
+        }
+    });
+    return rgb;
+}
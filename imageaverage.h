@@ -0,0 +1,66 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef IMAGEAVERAGE_H
+#define IMAGEAVERAGE_H
+
+// Combines several scans of the same original (same size tifs) pixel by pixel.
+// Inputs are read a strip of rows at a time, so memory is the number of inputs times
+// the strip height, not the image size. Inputs TiffStripReader can't decode (grayscale,
+// palette, separate planes, ...) are read whole by TiffRead() and take a full image each.
+
+#include "tiffresults.h"
+#include <memory>
+#include <string>
+
+// How each pixel is combined across the inputs
+enum class AverageStat { mean, median, clip };
+struct AverageMode {
+    AverageStat stat = AverageStat::mean;
+    float sigma = 2;        // clip: values further than sigma std devs from the median are dropped
+};
+AverageMode average_mode(const string &name);   // "mean", "median" or "clip[:sigma]", throws on anything else
+
+class StripAverager {
+public:
+    StripAverager(const vector<string> &files, float gamma, const AverageMode &mode);
+    // Returns the next nrows combined rows, fewer at the bottom of the image. The next
+    // strip of every input is decoded in parallel, then rows are combined on the pool.
+    ArrayRGB read(int nrows);
+    int nr, nc, dpi;            // image format, profile and bit depth are the first input's
+    bool from_16bits;
+    float gamma;
+    vector<uint8> profile;
+    int row = 0;                // next row read() returns
+private:
+    vector<std::unique_ptr<TiffStripReader>> in;    // null for inputs read whole
+    vector<ArrayRGB> whole;
+    AverageMode mode;
+};
+
+// mean is the float sum in input order divided by n, the same as adding whole images
+float combine_mean(const float *x, int n);
+float combine_median(float *x, int n);                 // reorders x
+float combine_clipped(float *x, int n, float sigma);   // reorders x
+
+#endif
@@ -0,0 +1,293 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "kernelcache.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char cache_magic[8] = { 'S', 'R', 'F', 'K', 'E', 'R', 'N', 0 };
+const uint32 cache_version = 1;
+
+struct CacheHeader {
+    char magic[8];
+    uint32 version;
+    uint32 kind;
+    uint32 dpi;
+    uint32 pad;
+    uint64 model;           // refl_model_hash()
+    uint64 key;             // kind specific parameters
+    uint64 payload_size;    // bytes following the header
+};
+
+// Whole contents of a file, empty if it can't be read
+vector<uint8> read_file(const string &name)
+{
+    std::ifstream in(name, std::ios::binary | std::ios::ate);
+    if (!in)
+        return {};
+    vector<uint8> bytes(static_cast<size_t>(in.tellg()));
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char *>(bytes.data()), bytes.size()))
+        return {};
+    return bytes;
+}
+
+// Payload encoding, native byte order. The header's version field catches a foreign one.
+struct Writer {
+    vector<uint8> bytes;
+    void put(const void *p, size_t n)
+    {
+        bytes.insert(bytes.end(), static_cast<const uint8 *>(p), static_cast<const uint8 *>(p) + n);
+    }
+    template<class T> void put(const T &x) { put(&x, sizeof(T)); }
+    template<class T, class A> void put(const vector<T, A> &v)
+    {
+        put(uint64(v.size()));
+        put(v.data(), v.size() * sizeof(T));
+    }
+};
+
+unsigned long process_id()
+{
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return static_cast<unsigned long>(getpid());
+#endif
+}
+
+uint64 double_bits(double x)
+{
+    uint64 bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+}
+
+
+// Reads back what Writer wrote, throws on running past the end
+struct KernelCache::Reader {
+    const uint8 *p, *end;
+    void get(void *dst, size_t n)
+    {
+        if (n > size_t(end - p))
+            throw "kernel cache file is short";
+        memcpy(dst, p, n);
+        p += n;
+    }
+    template<class T> void get(T &x) { get(&x, sizeof(T)); }
+    template<class T, class A> void get(vector<T, A> &v)
+    {
+        uint64 n;
+        get(n);
+        if (n > size_t(end - p) / sizeof(T))
+            throw "kernel cache file is short";
+        v.resize(n);
+        get(v.data(), n * sizeof(T));
+    }
+};
+
+
+KernelCache::KernelCache(const string &dir) : dir(dir) {}
+
+string KernelCache::path(Kind kind, int dpi, uint64 key) const
+{
+    std::ostringstream name;
+    name << dir << "/refl_" << kind << "_" << dpi << "_" << std::hex << std::setw(16) << std::setfill('0')
+        << (refl_model_hash() ^ key) << ".bin";
+    return name.str();
+}
+
+bool KernelCache::read(Kind kind, int dpi, uint64 key, const std::function<bool(Reader &)> &decode) const
+{
+    if (!enabled())
+        return false;
+    vector<uint8> file = read_file(path(kind, dpi, key));
+    if (file.size() < sizeof(CacheHeader))
+        return false;
+    CacheHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != cache_version
+        || header.kind != kind || header.dpi != uint32(dpi) || header.model != refl_model_hash()
+        || header.key != key || header.payload_size != file.size() - sizeof(CacheHeader))
+        return false;
+    Reader in{ file.data() + sizeof(CacheHeader), file.data() + file.size() };
+    try {
+        return decode(in);
+    }
+    catch (const char *) {
+        return false;
+    }
+}
+
+// Written to a temporary name then renamed so concurrent runs never read a partial file
+void KernelCache::write(Kind kind, int dpi, uint64 key, const vector<uint8> &payload) const
+{
+    if (!enabled())
+        return;
+    CacheHeader header{};
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.kind = kind;
+    header.dpi = dpi;
+    header.model = refl_model_hash();
+    header.key = key;
+    header.payload_size = payload.size();
+    string name = path(kind, dpi, key);
+    std::ostringstream tmp_name;
+    tmp_name << name << "." << process_id() << ".tmp";
+    {
+        std::ofstream out(tmp_name.str(), std::ios::binary);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+        if (!out)
+        {
+            out.close();
+            std::remove(tmp_name.str().c_str());
+            return;
+        }
+    }
+    std::remove(name.c_str());      // rename() won't replace an existing file on Windows
+    if (std::rename(tmp_name.str().c_str(), name.c_str()) != 0)
+        std::remove(tmp_name.str().c_str());
+}
+
+bool KernelCache::load(int dpi, ArrayRGB &refl_area) const
+{
+    return read(refl_area_kind, dpi, 0, [&](Reader &in) {
+        int nr, nc;
+        in.get(nr);
+        in.get(nc);
+        ArrayRGB area(0, 0, dpi);
+        for (auto &v : area.v)
+        {
+            in.get(v);
+            if (v.size() != size_t(nr) * nc)
+                return false;
+        }
+        area.nr = nr;
+        area.nc = nc;
+        refl_area = std::move(area);
+        return true;
+    });
+}
+
+void KernelCache::save(int dpi, const ArrayRGB &refl_area) const
+{
+    Writer out;
+    out.put(refl_area.nr);
+    out.put(refl_area.nc);
+    for (auto &v : refl_area.v)
+        out.put(v);
+    write(refl_area_kind, dpi, 0, out.bytes);
+}
+
+bool KernelCache::load(int dpi, KernelSpectrum &spectrum) const
+{
+    return read(spectrum_kind, dpi, 0, [&](Reader &in) {
+        KernelSpectrum ret;
+        int n;
+        in.get(ret.k);
+        in.get(ret.block);
+        in.get(n);
+        for (auto &s : ret.s)
+        {
+            in.get(s);
+            if (s.size() != size_t(n) * n)
+                return false;
+        }
+        ret.fft = FFT(n);       // twiddles are cheap, only the spectra are stored
+        spectrum = std::move(ret);
+        return true;
+    });
+}
+
+void KernelCache::save(int dpi, const KernelSpectrum &spectrum) const
+{
+    Writer out;
+    out.put(spectrum.k);
+    out.put(spectrum.block);
+    out.put(spectrum.fft.size());
+    for (auto &s : spectrum.s)
+        out.put(s);
+    write(spectrum_kind, dpi, 0, out.bytes);
+}
+
+bool KernelCache::load(int dpi, double max_error, SeparableKernel &kernel) const
+{
+    return read(separable_kind, dpi, double_bits(max_error), [&](Reader &in) {
+        SeparableKernel ret;
+        in.get(ret.k);
+        for (int color = 0; color < 3; color++)
+        {
+            in.get(ret.error[color]);
+            in.get(ret.rel_error[color]);
+            uint64 terms;
+            in.get(terms);
+            if (terms > size_t(ret.k))
+                return false;
+            ret.col[color].resize(terms);
+            ret.row[color].resize(terms);
+            for (uint64 t = 0; t < terms; t++)
+            {
+                in.get(ret.col[color][t]);
+                in.get(ret.row[color][t]);
+                if (ret.col[color][t].size() != size_t(ret.k) || ret.row[color][t].size() != size_t(ret.k))
+                    return false;
+            }
+        }
+        kernel = std::move(ret);
+        return true;
+    });
+}
+
+void KernelCache::save(int dpi, double max_error, const SeparableKernel &kernel) const
+{
+    Writer out;
+    out.put(kernel.k);
+    for (int color = 0; color < 3; color++)
+    {
+        out.put(kernel.error[color]);
+        out.put(kernel.rel_error[color]);
+        out.put(uint64(kernel.col[color].size()));
+        for (size_t t = 0; t < kernel.col[color].size(); t++)
+        {
+            out.put(kernel.col[color][t]);
+            out.put(kernel.row[color][t]);
+        }
+    }
+    write(separable_kind, dpi, double_bits(max_error), out.bytes);
+}
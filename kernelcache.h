@@ -0,0 +1,60 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef KERNELCACHE_H
+#define KERNELCACHE_H
+
+// Versioned binary cache of reflection kernels and the forms the convolve engines
+// derive from them, one file per kernel in a directory. Files are keyed by reduced dpi,
+// the reflection model constants (refl_model_hash()) and for separable kernels the
+// requested max error. Files are read whole when loaded. Anything that doesn't match
+// (other version, other model, short file) is a miss and is rebuilt and rewritten.
+
+#include "tiffresults.h"
+#include "reflconvolve.h"
+#include <functional>
+
+class KernelCache {
+public:
+    explicit KernelCache(const string &dir);     // "" disables the cache
+    bool enabled() const { return !dir.empty(); }
+
+    // load() returns false on a miss, save() ignores write failures
+    bool load(int dpi, ArrayRGB &refl_area) const;
+    void save(int dpi, const ArrayRGB &refl_area) const;
+    bool load(int dpi, KernelSpectrum &spectrum) const;
+    void save(int dpi, const KernelSpectrum &spectrum) const;
+    bool load(int dpi, double max_error, SeparableKernel &kernel) const;
+    void save(int dpi, double max_error, const SeparableKernel &kernel) const;
+
+private:
+    enum Kind : uint32 { refl_area_kind = 1, spectrum_kind = 2, separable_kind = 3 };
+    struct Reader;
+    string path(Kind kind, int dpi, uint64 key) const;
+    // reads the file and decodes its payload, false on a miss or if decode does
+    bool read(Kind kind, int dpi, uint64 key, const std::function<bool(Reader &)> &decode) const;
+    void write(Kind kind, int dpi, uint64 key, const vector<uint8> &payload) const;
+    string dir;
+};
+
+#endif
@@ -0,0 +1,158 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "pixelstorage.h"
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#include <immintrin.h>
+#define STORAGE_F16C
+#endif
+
+
+Storage storage_type(const std::string &name)
+{
+    if (name == "float")
+        return Storage::float32;
+    if (name == "half")
+        return Storage::float16;
+    if (name == "uint16")
+        return Storage::uint16;
+    throw "-H type:   type must be float, half or uint16\n";
+}
+
+float half_to_float(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t x;
+    if (exponent == 0x1f)                   // inf, nan
+        x = sign | 0x7f800000 | (mantissa << 13);
+    else if (exponent != 0)
+        x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        x = sign;
+    else
+    {
+        // subnormal, shift up until the implicit bit is set
+        uint32_t e = 113;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            e--;
+        }
+        x = sign | (e << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t a = x & 0x7fffffff;
+    if (a >= 0x7f800000)                    // inf, nan
+        return uint16_t(sign | 0x7c00 | (a > 0x7f800000 ? 0x200 : 0));
+    if (a >= 0x477ff000)                    // rounds past 65504
+        return uint16_t(sign | 0x7c00);
+    if (a < 0x38800000)                     // below 2^-14, subnormal or 0
+    {
+        if (a < 0x33000000)
+            return uint16_t(sign);
+        uint32_t mantissa = (a & 0x7fffff) | 0x800000;
+        int shift = 126 - int(a >> 23);
+        uint32_t h = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1)))
+            h++;
+        return uint16_t(sign | h);
+    }
+    uint32_t h = (a - 0x38000000) >> 13;    // rebias exponent from 127 to 15
+    uint32_t rest = a & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        h++;
+    return uint16_t(sign | h);
+}
+
+void widen(const uint16_t *src, float *dst, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256 scale = _mm256_set1_ps(1.f / 65535);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = to_float(src[i]);
+}
+
+void widen(const half *src, float *dst, int n)
+{
+    int i = 0;
+#if defined(STORAGE_F16C)
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i))));
+#endif
+    for (; i < n; i++)
+        dst[i] = to_float(src[i]);
+}
+
+void narrow(const float *src, uint16_t *dst, int n)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+    const __m256 scale = _mm256_set1_ps(65535.f), round = _mm256_set1_ps(.5f);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 x = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + i), zero), one);
+        __m256i v = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(x, scale), round));
+        // packus works within 128 bit lanes, gather the two halves back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm256_castsi256_si128(packed));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = from_float<uint16_t>(src[i]);
+}
+
+void narrow(const float *src, half *dst, int n)
+{
+    int i = 0;
+#if defined(STORAGE_F16C)
+    for (; i + 8 <= n; i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+    for (; i < n; i++)
+        dst[i] = from_float<half>(src[i]);
+}
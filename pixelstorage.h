@@ -0,0 +1,59 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef PIXELSTORAGE_H
+#define PIXELSTORAGE_H
+
+// Sample types for full resolution images (ArrayRGBT<T>). Values are linear [0:1] in
+// all of them: float as is, uint16 as round(x*65535) and half as IEEE binary16.
+// Arithmetic is always float. Stages widen a row to float, work on it, and narrow it back.
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+enum class Storage { float32, float16, uint16 };
+Storage storage_type(const std::string &name);     // "float", "half" or "uint16", throws on anything else
+
+struct half {
+    uint16_t bits;
+};
+float half_to_float(uint16_t h);
+uint16_t float_to_half(float x);       // round to nearest even
+
+inline float to_float(float x) { return x; }
+inline float to_float(uint16_t x) { return x * (1.f / 65535); }
+inline float to_float(half x) { return half_to_float(x.bits); }
+
+template<class T> T from_float(float x);
+template<> inline float from_float<float>(float x) { return x; }
+template<> inline uint16_t from_float<uint16_t>(float x) { return static_cast<uint16_t>(std::clamp(x, 0.f, 1.f) * 65535 + .5f); }
+template<> inline half from_float<half>(float x) { return half{ float_to_half(x) }; }
+
+// n samples at a time, SIMD when the compiler targets AVX2 (uint16) or F16C (half)
+void widen(const uint16_t *src, float *dst, int n);
+void widen(const half *src, float *dst, int n);
+void narrow(const float *src, uint16_t *dst, int n);
+void narrow(const float *src, half *dst, int n);
+
+#endif
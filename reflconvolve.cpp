@@ -0,0 +1,464 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "reflconvolve.h"
+#include <algorithm>
+#include <utility>
+#include <tuple>
+
+using cfloat = FFT::cfloat;
+
+ConvolveMode convolve_mode(const string &name)
+{
+    if (name == "direct")
+        return ConvolveMode::direct;
+    if (name == "fft")
+        return ConvolveMode::fft;
+    if (name == "svd")
+        return ConvolveMode::svd;
+    if (name == "multires")
+        return ConvolveMode::multires;
+    throw "-C mode:   mode must be direct, fft, svd or multires\n";
+}
+
+
+FFT::FFT(int n) : n(n)
+{
+    assert(n >= 0 && (n & (n - 1)) == 0);
+    if (n == 0)
+        return;
+    // twiddles in double then rounded, keeps error from growing with n
+    const double pi = 3.14159265358979323846;
+    twiddle.resize(n / 2);
+    for (int i = 0; i < n / 2; i++)
+        twiddle[i] = cfloat(static_cast<float>(cos(-2 * pi * i / n)), static_cast<float>(sin(-2 * pi * i / n)));
+    int bits = 0;
+    while ((1 << bits) < n) bits++;
+    bitrev.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+        bitrev[i] = r;
+    }
+}
+
+void FFT::transform(cfloat *data, bool inverse) const
+{
+    for (int i = 0; i < n; i++)
+        if (i < bitrev[i])
+            std::swap(data[i], data[bitrev[i]]);
+    for (int len = 2; len <= n; len <<= 1)
+    {
+        int half = len / 2;
+        int step = n / len;
+        for (int i = 0; i < n; i += len)
+        {
+            for (int j = 0; j < half; j++)
+            {
+                cfloat w = inverse ? std::conj(twiddle[j*step]) : twiddle[j*step];
+                cfloat u = data[i + j];
+                cfloat v = data[i + j + half] * w;
+                data[i + j] = u + v;
+                data[i + j + half] = u - v;
+            }
+        }
+    }
+}
+
+void FFT::transform2d(vector<cfloat> &data, bool inverse) const
+{
+    assert(data.size() == size_t(n)*n);
+    for (int r = 0; r < n; r++)
+        transform(&data[size_t(r)*n], inverse);
+    vector<cfloat> column(n);
+    for (int c = 0; c < n; c++)
+    {
+        for (int r = 0; r < n; r++) column[r] = data[size_t(r)*n + c];
+        transform(column.data(), inverse);
+        for (int r = 0; r < n; r++) data[size_t(r)*n + c] = column[r];
+    }
+}
+
+
+KernelSpectrum kernel_spectrum(const ArrayRGB &refl_area)
+{
+    assert(refl_area.nr == refl_area.nc);
+    KernelSpectrum ret;
+    ret.k = refl_area.nr;
+    int n = 1;
+    while (n < 2 * ret.k) n <<= 1;      // at least k+1 valid outputs per block
+    ret.fft = FFT(n);
+    ret.block = n - ret.k + 1;
+    for (int color = 0; color < 3; color++)
+    {
+        auto &s = ret.s[color];
+        s.assign(size_t(n)*n, 0);
+        for (int r = 0; r < ret.k; r++)
+            for (int c = 0; c < ret.k; c++)
+                s[size_t(r)*n + c] = refl_area(r, c, color);
+        ret.fft.transform2d(s, false);
+        // generate_reflected_light_estimate() correlates, sum(image(i+j)*refl(j)),
+        // which is the inverse transform of image spectrum * conj(kernel spectrum).
+        // Fold in the 1/n^2 inverse scale here as well.
+        float scale = 1.0f / (float(n)*n);
+        for (auto &x : s)
+            x = std::conj(x) * scale;
+    }
+    return ret;
+}
+
+
+// Overlap-save: each n x n block of the reduced image yields block x block valid
+// outputs of the circular correlation. Kernel spectrum is shared by all blocks.
+ArrayRGB generate_reflected_light_estimate(const ArrayRGB &image_reduced, const KernelSpectrum &spectrum)
+{
+    ArrayRGB image_correction = ArrayRGB(image_reduced.nr - 2 * image_reduced.dpi,
+        image_reduced.nc - 2 * image_reduced.dpi,
+        image_reduced.dpi,
+        image_reduced.from_16bits,
+        image_reduced.gamma
+    );
+    assert(image_correction.nr == image_reduced.nr - spectrum.k + 1);
+
+    // one task per block per color
+    const int b = spectrum.block;
+    const int blocks_r = (image_correction.nr + b - 1) / b;
+    const int blocks_c = (image_correction.nc + b - 1) / b;
+    auto fix = [&image_reduced, &spectrum, &image_correction, b](int color, int bi, int bj) {
+        const int n = spectrum.fft.size();
+        vector<cfloat> tile(size_t(n)*n);
+        // load block, zero fill past the image edge (only feeds discarded outputs)
+        for (int r = 0; r < n; r++)
+        {
+            for (int c = 0; c < n; c++)
+            {
+                bool inside = bi + r < image_reduced.nr && bj + c < image_reduced.nc;
+                tile[size_t(r)*n + c] = inside ? image_reduced(bi + r, bj + c, color) : 0.f;
+            }
+        }
+        spectrum.fft.transform2d(tile, false);
+        for (size_t i = 0; i < tile.size(); i++)
+            tile[i] *= spectrum.s[color][i];
+        spectrum.fft.transform2d(tile, true);
+        int er = std::min(b, image_correction.nr - bi);
+        int ec = std::min(b, image_correction.nc - bj);
+        for (int r = 0; r < er; r++)
+            for (int c = 0; c < ec; c++)
+                image_correction(bi + r, bj + c, color) = tile[size_t(r)*n + c].real();
+    };
+    thread_pool().parallel_for(3 * blocks_r * blocks_c, [&](int i) {
+        int color = i / (blocks_r * blocks_c);
+        int block = i % (blocks_r * blocks_c);
+        fix(color, block / blocks_c * b, block % blocks_c * b);
+    });
+    return image_correction;
+}
+
+
+SeparableKernel separable_kernel(const ArrayRGB &refl_area, double max_error)
+{
+    assert(refl_area.nr == refl_area.nc);
+    SeparableKernel ret;
+    const int k = ret.k = refl_area.nr;
+    for (int color = 0; color < 3; color++)
+    {
+        // residual, starts as the kernel and has each extracted term removed
+        vector<double> res(size_t(k)*k);
+        for (int r = 0; r < k; r++)
+            for (int c = 0; c < k; c++)
+                res[size_t(r)*k + c] = refl_area(r, c, color);
+        auto norms = [&res]() {
+            double l1 = 0, l2 = 0;
+            for (auto x : res) { l1 += std::abs(x); l2 += x*x; }
+            return std::make_pair(l1, sqrt(l2));
+        };
+        const double norm0 = norms().second;
+
+        vector<double> u(k), v(k), w(k);
+        auto [l1, l2] = norms();
+        while (l1 > max_error && ret.col[color].size() < size_t(k))
+        {
+            // power iteration on res'*res for the largest remaining singular vector,
+            // started from the residual row with the most energy
+            int best = 0; double best_norm = -1;
+            for (int r = 0; r < k; r++)
+            {
+                double n = 0;
+                for (int c = 0; c < k; c++) n += res[size_t(r)*k + c] * res[size_t(r)*k + c];
+                if (n > best_norm) { best_norm = n; best = r; }
+            }
+            for (int c = 0; c < k; c++) v[c] = res[size_t(best)*k + c];
+            for (int iter = 0; iter < 500; iter++)
+            {
+                for (int r = 0; r < k; r++)
+                {
+                    double s = 0;
+                    for (int c = 0; c < k; c++) s += res[size_t(r)*k + c] * v[c];
+                    u[r] = s;
+                }
+                std::fill(w.begin(), w.end(), 0.0);
+                for (int r = 0; r < k; r++)
+                    for (int c = 0; c < k; c++) w[c] += res[size_t(r)*k + c] * u[r];
+                double n = 0;
+                for (auto x : w) n += x*x;
+                n = sqrt(n);
+                if (n == 0) break;
+                double change = 0;
+                for (int c = 0; c < k; c++) { w[c] /= n; change += (w[c] - v[c])*(w[c] - v[c]); }
+                v.swap(w);
+                if (change < 1e-20) break;
+            }
+            // col = res*v (carries the singular value), row = v
+            vector<float> col(k), row(k);
+            for (int r = 0; r < k; r++)
+            {
+                double s = 0;
+                for (int c = 0; c < k; c++) s += res[size_t(r)*k + c] * v[c];
+                u[r] = s;
+            }
+            for (int r = 0; r < k; r++) col[r] = static_cast<float>(u[r]);
+            for (int c = 0; c < k; c++) row[c] = static_cast<float>(v[c]);
+            // remove the term as stored (float) so the reported error is what is applied
+            for (int r = 0; r < k; r++)
+                for (int c = 0; c < k; c++)
+                    res[size_t(r)*k + c] -= double(col[r])*row[c];
+            ret.col[color].push_back(col);
+            ret.row[color].push_back(row);
+            std::tie(l1, l2) = norms();
+        }
+        ret.error[color] = l1;
+        ret.rel_error[color] = norm0 > 0 ? l2 / norm0 : 0;
+    }
+    return ret;
+}
+
+
+ArrayRGB generate_reflected_light_estimate(const ArrayRGB &image_reduced, const SeparableKernel &kernel)
+{
+    ArrayRGB image_correction = ArrayRGB(image_reduced.nr - 2 * image_reduced.dpi,
+        image_reduced.nc - 2 * image_reduced.dpi,
+        image_reduced.dpi,
+        image_reduced.from_16bits,
+        image_reduced.gamma
+    );
+    assert(image_correction.nr == image_reduced.nr - kernel.k + 1);
+
+    // Row pass for every term into tmp, then column pass over output row bands.
+    // Each output sums terms in the same order however the bands are split.
+    const int k = kernel.k;
+    const int out_nc = image_correction.nc;
+    const int rank = kernel.rank();
+    const size_t plane = size_t(image_reduced.nr)*out_nc;
+    vector<float> tmp(3 * rank * plane);
+    parallel_bands(image_reduced.nr, [&](int ct, int s_row, int e_row) {
+        int color = ct / rank;
+        const auto &row = kernel.row[color][ct % rank];
+        for (int i = s_row; i < e_row; i++)
+        {
+            const float *in = &image_reduced.v[color][size_t(i)*image_reduced.nc];
+            float *dst = &tmp[ct * plane + size_t(i)*out_nc];
+            for (int ii = 0; ii < out_nc; ii++)
+            {
+                float sum = 0;
+                for (int jj = 0; jj < k; jj++)
+                    sum += in[ii + jj] * row[jj];
+                dst[ii] = sum;
+            }
+        }
+    }, 3 * rank);
+    parallel_bands(image_correction.nr, [&](int color, int s_row, int e_row) {
+        auto &out = image_correction.v[color];
+        std::fill(out.begin() + size_t(s_row)*out_nc, out.begin() + size_t(e_row)*out_nc, 0.f);
+        for (int t = 0; t < rank; t++)
+        {
+            const auto &col = kernel.col[color][t];
+            const float *plane_t = &tmp[(color * rank + t) * plane];
+            for (int i = s_row; i < e_row; i++)
+            {
+                float *dst = &out[size_t(i)*out_nc];
+                for (int j = 0; j < k; j++)
+                {
+                    const float *src = plane_t + size_t(i + j)*out_nc;
+                    const float w = col[j];
+                    for (int ii = 0; ii < out_nc; ii++)
+                        dst[ii] += w * src[ii];
+                }
+            }
+        }
+    });
+    return image_correction;
+}
+
+
+// Coarse pixel b covers fine pixels [b*block, (b+1)*block). Fine pixel p lies between the
+// centers of coarse pixels cell and cell+1, frac of the way from the first.
+static int coarse_cell(int p, int block, float &frac)
+{
+    double t = (p - (block - 1) / 2.0) / block;
+    int cell = static_cast<int>(floor(t));
+    frac = static_cast<float>(t - cell);
+    return cell;
+}
+
+MultiresKernel multires_kernel(const ArrayRGB &refl_area, int block, int near)
+{
+    assert(refl_area.nr == refl_area.nc && refl_area.nr % 2 == 1 && block >= 2);
+    MultiresKernel ret;
+    const int g = refl_area.nr / 2;     // kernel radius in fine pixels
+    ret.k = refl_area.nr;
+    ret.block = block;
+    ret.near = near = std::min(near, g);
+    const int half = block / 2;
+    const int radius = (g + half) / block + 1;          // +1 for the sharpening
+    ret.far = ArrayRGB(2 * radius + 1, 2 * radius + 1, radius);
+    // Variance in coarse pixels^2 added by the block sums of the kernel and the block
+    // averages of the image, (block^2-1)/12 fine pixels^2 each, and by bilinear
+    // interpolation, 1/6 coarse pixels^2. Subtracting half of it times the laplacian
+    // takes it out to second order.
+    const double spread = ((double(block) * block - 1) / 6 + double(block) * block / 6) / (double(block) * block);
+    const int span = 2 * near + 1;
+    // Weights of the fine taps of a block centered on a coarse tap, the end taps of an
+    // even block are shared with the next block
+    vector<double> share(2 * half + 1, 1.0);
+    if (block % 2 == 0)
+        share.front() = share.back() = .5;
+    for (int color = 0; color < 3; color++)
+    {
+        auto fine = [&](int r, int c) -> double {
+            return abs(r) > g || abs(c) > g ? 0 : refl_area(g + r, g + c, color);
+        };
+        // Each coarse tap is the sum of the fine taps around it. Point samples would give
+        // the kernel's ridges along the axes block times their weight.
+        auto sampled = [&](int u, int v) -> double {
+            double sum = 0;
+            for (int a = -half; a <= half; a++)
+                for (int b = -half; b <= half; b++)
+                    sum += share[a + half] * share[b + half] * fine(u * block + a, v * block + b);
+            return sum;
+        };
+        for (int u = -radius; u <= radius; u++)
+            for (int v = -radius; v <= radius; v++)
+            {
+                double laplacian = sampled(u - 1, v) + sampled(u + 1, v) + sampled(u, v - 1) + sampled(u, v + 1) - 4 * sampled(u, v);
+                ret.far(u + radius, v + radius, color) = static_cast<float>(sampled(u, v) - spread / 2 * laplacian);
+            }
+        auto far = [&](int u, int v) -> double {
+            if (abs(u) > radius || abs(v) > radius)
+                return 0;
+            return ret.far(u + radius, v + radius, color);
+        };
+        // Fine pixel (pr, pc) of block (0, 0) gets weight wr*wc*far(b - j) / block^2 from the
+        // average of block b through each coarse output j it interpolates between
+        auto &taps = ret.near_taps[color];
+        taps.resize(size_t(block) * block * span * span);
+        for (int pr = 0; pr < block; pr++)
+            for (int pc = 0; pc < block; pc++)
+            {
+                float fr, fc;
+                int jr = coarse_cell(pr, block, fr), jc = coarse_cell(pc, block, fc);
+                float *t = &taps[size_t(pr * block + pc) * span * span];
+                for (int dr = -near; dr <= near; dr++)
+                    for (int dc = -near; dc <= near; dc++)
+                    {
+                        int br = static_cast<int>(floor(double(pr + dr) / block));
+                        int bc = static_cast<int>(floor(double(pc + dc) / block));
+                        double far_part = ((1 - fr) * (1 - fc) * far(br - jr, bc - jc) + (1 - fr) * fc * far(br - jr, bc - jc - 1)
+                            + fr * (1 - fc) * far(br - jr - 1, bc - jc) + fr * fc * far(br - jr - 1, bc - jc - 1)) / (double(block) * block);
+                        t[(dr + near) * span + dc + near] = static_cast<float>(fine(dr, dc) - far_part);
+                    }
+            }
+    }
+    ret.far_spectrum = kernel_spectrum(ret.far);
+    return ret;
+}
+
+
+ArrayRGB generate_reflected_light_estimate(const ArrayRGB &image_reduced, const MultiresKernel &kernel)
+{
+    ArrayRGB image_correction = ArrayRGB(image_reduced.nr - 2 * image_reduced.dpi,
+        image_reduced.nc - 2 * image_reduced.dpi,
+        image_reduced.dpi,
+        image_reduced.from_16bits,
+        image_reduced.gamma
+    );
+    assert(image_correction.nr == image_reduced.nr - kernel.k + 1);
+    const int g = kernel.k / 2, block = kernel.block, near = kernel.near, radius = kernel.far.dpi;
+    const int nr = image_reduced.nr, nc = image_reduced.nc;
+
+    // Coarse pixels the outputs interpolate between, rows row0 to last_row, columns col0 to last_col
+    float frac;
+    const int row0 = coarse_cell(g, block, frac), last_row = coarse_cell(nr - 1 - g, block, frac) + 1;
+    const int col0 = coarse_cell(g, block, frac), last_col = coarse_cell(nc - 1 - g, block, frac) + 1;
+    // Block averages of those plus radius around them. Blocks that reach past the image
+    // repeat its edge pixels, which are surround at the edge reflectance.
+    ArrayRGB averages(last_row - row0 + 1 + 2 * radius, last_col - col0 + 1 + 2 * radius, radius);
+    const float area = 1.0f / (block * block);
+    parallel_bands(averages.nr, [&](int color, int s_row, int e_row) {
+        for (int i = s_row; i < e_row; i++)
+            for (int ii = 0; ii < averages.nc; ii++)
+            {
+                float sum = 0;
+                for (int j = 0; j < block; j++)
+                {
+                    int r = std::clamp((row0 - radius + i) * block + j, 0, nr - 1);
+                    for (int jj = 0; jj < block; jj++)
+                        sum += image_reduced(r, std::clamp((col0 - radius + ii) * block + jj, 0, nc - 1), color);
+                }
+                averages(i, ii, color) = sum * area;
+            }
+    });
+    // coarse pixel (row0, col0) is at (0, 0)
+    const ArrayRGB far = generate_reflected_light_estimate(averages, kernel.far_spectrum);
+
+    vector<int> cols(image_correction.nc);
+    vector<float> col_frac(image_correction.nc);
+    for (int ii = 0; ii < image_correction.nc; ii++)
+        cols[ii] = coarse_cell(ii + g, block, col_frac[ii]) - col0;
+    const int span = 2 * near + 1;
+    parallel_bands(image_correction.nr, [&](int color, int s_row, int e_row) {
+        for (int i = s_row; i < e_row; i++)
+        {
+            const int p = i + g;
+            float fr;
+            const int r = coarse_cell(p, block, fr) - row0;
+            const float *far0 = &far(r, 0, color), *far1 = &far(r + 1, 0, color);
+            const float *phase_taps = &kernel.near_taps[color][size_t(p % block) * block * span * span];
+            for (int ii = 0; ii < image_correction.nc; ii++)
+            {
+                const int q = ii + g, c = cols[ii];
+                const float fc = col_frac[ii];
+                float sum = (1 - fr) * ((1 - fc) * far0[c] + fc * far0[c + 1]) + fr * ((1 - fc) * far1[c] + fc * far1[c + 1]);
+                const float *taps = phase_taps + size_t(q % block) * span * span;
+                for (int j = 0; j < span; j++)
+                {
+                    const float *src = &image_reduced(p - near + j, q - near, color);
+                    for (int jj = 0; jj < span; jj++)
+                        sum += src[jj] * taps[j * span + jj];
+                }
+                image_correction(i, ii, color) = sum;
+            }
+        }
+    });
+    return image_correction;
+}
@@ -0,0 +1,110 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef REFLCONVOLVE_H
+#define REFLCONVOLVE_H
+
+// Alternatives to the direct convolution in generate_reflected_light_estimate().
+// All produce the same correction field as the direct sum to within float rounding
+// (fft), a requested approximation error (svd) or a fixed small error (multires).
+
+#include "tiffresults.h"
+#include <complex>
+#include <string>
+
+// Selects the engine used to convolve the reduced image with the reflection kernel
+enum class ConvolveMode { direct, fft, svd, multires };
+ConvolveMode convolve_mode(const string &name);     // "direct", "fft", "svd" or "multires", throws on anything else
+
+
+// Radix 2 complex FFT of a fixed power of 2 size. Twiddles and bit reversal are
+// computed once so the same object can be reused for every row and column.
+class FFT {
+public:
+    using cfloat = std::complex<float>;
+    explicit FFT(int n = 0);
+    int size() const { return n; }
+    void transform(cfloat *data, bool inverse) const;           // in place, unscaled
+    void transform2d(vector<cfloat> &data, bool inverse) const; // n x n, row major, unscaled
+private:
+    int n;
+    vector<cfloat> twiddle;
+    vector<int> bitrev;
+};
+
+
+// Spectrum of the reflection kernel for overlap-save convolution.
+// Depends only on the kernel, not on the image, so it is computed once
+// and reused for every block and every channel of every image at that DPI.
+struct KernelSpectrum {
+    int k = 0;              // kernel size (refl_area.nr == refl_area.nc, odd)
+    int block = 0;          // valid output rows/cols produced per FFT block, fft.size()-k+1
+    FFT fft;
+    vector<FFT::cfloat> s[3];   // conjugated kernel spectra (correlation), one per color
+};
+KernelSpectrum kernel_spectrum(const ArrayRGB &refl_area);
+
+// Same result as generate_reflected_light_estimate(image_reduced, refl_area) to within
+// 1e-5 absolute, correction values are at most refl_fraction (.2). Both are float sums.
+ArrayRGB generate_reflected_light_estimate(const ArrayRGB &image_reduced, const KernelSpectrum &spectrum);
+
+
+
+// Reflection kernel as a sum of separable terms, refl(r, c) ~= sum over t of col[t][r]*row[t][c]
+// Terms are taken from the SVD (largest singular values first) until the dropped
+// remainder can change no correction value by more than max_error. Image values are
+// in [0:1] so that bound is the sum of the absolute values of the residual kernel.
+struct SeparableKernel {
+    int k = 0;                              // kernel size
+    vector<vector<float>> col[3], row[3];   // per color, one entry per term
+    double error[3] = {};                   // achieved bound on correction error
+    double rel_error[3] = {};               // achieved |refl - approx| / |refl|, Frobenius norm
+    int rank() const { return (int)col[0].size(); }
+};
+SeparableKernel separable_kernel(const ArrayRGB &refl_area, double max_error);
+
+// k pairs of 1D passes per color instead of k*k taps per output
+ArrayRGB generate_reflected_light_estimate(const ArrayRGB &image_reduced, const SeparableKernel &kernel);
+
+
+// Reflection kernel split into a far field for block averages of the reduced image and
+// a near field residual at the reduced image's own grid. The far field is the kernel
+// summed over block x block taps, sharpened to offset the blur of the block sums and of
+// the bilinear interpolation back to the fine grid. The near field is, for each of the
+// block*block positions of a pixel within its block, the exact kernel minus what the far
+// field already contributes, for offsets up to near pixels. Past that the residual is
+// dropped. Correction error against the direct sum is under 3e-4.
+struct MultiresKernel {
+    int k = 0;                          // fine kernel size (refl_area.nr == refl_area.nc, odd)
+    int block = 0;                      // fine pixels per coarse pixel, each way
+    int near = 0;                       // near field radius in fine pixels
+    ArrayRGB far;                       // coarse kernel, radius far.dpi
+    KernelSpectrum far_spectrum;        // of far, the far field is convolved by overlap-save
+    vector<float> near_taps[3];         // per color, block*block positions of (2*near+1)^2 taps
+};
+MultiresKernel multires_kernel(const ArrayRGB &refl_area, int block, int near = 4);
+
+// FFT convolution of the block averages with the far kernel, bilinear interpolation of
+// that, plus (2*near+1)^2 near field taps per output
+ArrayRGB generate_reflected_light_estimate(const ArrayRGB &image_reduced, const MultiresKernel &kernel);
+
+#endif
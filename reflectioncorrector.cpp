@@ -0,0 +1,241 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "reflectioncorrector.h"
+#include "threadpool.h"
+#include "trace.h"
+#include <type_traits>
+
+ReflectionCorrector::ReflectionCorrector(const CorrectorOptions &options)
+    : opts(options), cache(options.kernel_cache_dir)
+{
+}
+
+const Kernel &ReflectionCorrector::kernel(int dpi) const
+{
+    std::lock_guard<std::mutex> lock(m);
+    auto found = kernels.find(dpi);
+    if (found != kernels.end())
+        return found->second;
+    TraceSpan span("kernel");
+    Kernel kernel;
+    int refl_dpi = reduced_refl_dpi(dpi, kernel.x2, kernel.x3);
+    int rate = 1;
+    if (opts.convolve == ConvolveMode::multires)
+    {
+        // the near field at one reduction step finer, the far field at half the usual dpi
+        if (kernel.x2 > 0) { kernel.x2--; rate = 2; }
+        else if (kernel.x3 > 0) { kernel.x3--; rate = 3; }
+        refl_dpi *= rate;
+    }
+    if (!cache.load(refl_dpi, kernel.refl_area))
+    {
+        kernel.refl_area = std::get<0>(getReflArea(dpi, refl_dpi));
+        cache.save(refl_dpi, kernel.refl_area);
+    }
+    switch (opts.convolve)
+    {
+    case ConvolveMode::fft:
+        if (!cache.load(refl_dpi, kernel.spectrum))
+        {
+            kernel.spectrum = kernel_spectrum(kernel.refl_area);
+            cache.save(refl_dpi, kernel.spectrum);
+        }
+        break;
+    case ConvolveMode::svd:
+        if (!cache.load(refl_dpi, opts.svd_max_error, kernel.separable))
+        {
+            kernel.separable = separable_kernel(kernel.refl_area, opts.svd_max_error);
+            cache.save(refl_dpi, opts.svd_max_error, kernel.separable);
+        }
+        break;
+    case ConvolveMode::multires:
+        kernel.multires = multires_kernel(kernel.refl_area, 2 * rate);  // cheap, not cached
+        break;
+    default:
+        break;
+    }
+    return kernels.emplace(dpi, std::move(kernel)).first->second;
+}
+
+// Equivalent to x3 3x downsizes then x2 2x downsizes, with a 1" margin of edge_reflectance
+// since light is re-reflected over around an inch
+Decimator ReflectionCorrector::decimator(const Kernel &kernel, int nr, int nc, int dpi) const
+{
+    vector<int> rates(kernel.x3, 3);
+    rates.insert(rates.end(), kernel.x2, 2);
+    return Decimator(nr, nc, dpi, rates, dpi, opts.edge_reflectance);
+}
+
+// Convolve downsampled image (with 1" surround) with the reflection kernel using the selected engine
+ArrayRGB ReflectionCorrector::reflected_light(const ArrayRGB &image_reduced, const Kernel &kernel) const
+{
+    TraceSpan span("convolve", 12.0 * image_reduced.v[0].size());
+    switch (opts.convolve)
+    {
+    case ConvolveMode::fft:
+        return generate_reflected_light_estimate(image_reduced, kernel.spectrum);
+    case ConvolveMode::svd:
+        return generate_reflected_light_estimate(image_reduced, kernel.separable);
+    case ConvolveMode::multires:
+        return generate_reflected_light_estimate(image_reduced, kernel.multires);
+    default:
+        return generate_reflected_light_estimate(image_reduced, kernel.refl_area);
+    }
+}
+
+// Subtract re-reflected light from original (or add it when simulating)
+CorrectionApplier ReflectionCorrector::applier(const ArrayRGB &correction, const Kernel &kernel, int dpi, int nc, int first_col) const
+{
+    return CorrectionApplier(correction, dpi / kernel.refl_area.dpi, nc, opts.simulate, gain(), first_col);
+}
+
+// gain restore  adjusts gain to offset reduction from re-reflected light subtraction
+float ReflectionCorrector::gain() const
+{
+    return opts.simulate ? .785f / .876f : opts.no_gain_restore ? 1.0f : .876f / .785f;
+}
+
+// Adjust for Relative Colorimetric w/o shift to WP (no tint change)
+// Should not be used to process scanner profiling patch scans
+template<class T>
+void ReflectionCorrector::adjust_to_white(ArrayRGBT<T> &image, const SampleHistogram &histogram) const
+{
+    TraceSpan span("white-detect", 3.0 * sizeof(T) * image.v[0].size());
+    float maxcolor = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        size_t n = image.v[i].size();
+        float high = histogram.select(image, i, n - (1 + n / 10000));   // as if sorted
+        if (high > maxcolor) maxcolor = high;
+    }
+    image.scale(1 / maxcolor);
+}
+
+template<class T>
+void ReflectionCorrector::correct(ArrayRGBT<T> &image) const
+{
+    TraceSpan span("correct", 3.0 * sizeof(T) * image.v[0].size());
+    const Kernel &k = kernel(image.dpi);
+    ArrayRGB image_reduced = decimator(k, image.nr, image.nc, image.dpi).decimate(image);
+    ArrayRGB correction = reflected_light(image_reduced, k);
+    SampleHistogram histogram;
+    applier(correction, k, image.dpi, image.nc).apply(image, 0, opts.adjust_to_white ? &histogram : nullptr);
+    if (opts.adjust_to_white)
+        adjust_to_white(image, histogram);
+}
+
+
+// Bytes from the start of a buffer to sample (or color) s of pixel c in row r, and the
+// samples between neighboring pixels
+static ptrdiff_t sample_offset(const PixelBuffer &b, int r, int c, int s)
+{
+    ptrdiff_t bytes = b.bits / 8;
+    ptrdiff_t row_stride = b.row_stride ? b.row_stride : bytes * b.nc * (b.planar ? 1 : b.channels);
+    ptrdiff_t plane_stride = b.plane_stride ? b.plane_stride : row_stride * b.nr;
+    if (b.planar)
+        return s * plane_stride + r * row_stride + c * bytes;
+    return r * row_stride + (ptrdiff_t(c) * b.channels + s) * bytes;
+}
+
+static void check_buffer(const PixelBuffer &b)
+{
+    if (b.data == nullptr || b.nr <= 0 || b.nc <= 0)
+        throw "PixelBuffer has no pixels";
+    if (b.bits != 8 && b.bits != 16)
+        throw "PixelBuffer samples must be 8 or 16 bits";
+    if (!b.planar && b.channels < 3)
+        throw "PixelBuffer needs at least 3 interleaved samples per pixel";
+}
+
+// Buffer rows to linear samples, with the same tables TiffRead() uses
+template<class T, class S>
+static void decode_buffer(const PixelBuffer &in, float gamma, ArrayRGBT<T> &image)
+{
+    const vector<float> &table = decode_table(in.bits, gamma);
+    vector<T> converted;
+    const T *lut;
+    if constexpr (std::is_same_v<T, float>)
+        lut = table.data();
+    else
+    {
+        for (float x : table)
+            converted.push_back(from_float<T>(x));
+        lut = converted.data();
+    }
+    int step = in.planar ? 1 : in.channels;
+    parallel_bands(in.nr, [&](int color, int start_row, int end_row) {
+        for (int r = start_row; r < end_row; r++)
+        {
+            const S *src = reinterpret_cast<const S *>(static_cast<const uint8 *>(in.data) + sample_offset(in, r, 0, color));
+            T *dst = &image(r, 0, color);
+            for (int c = 0; c < in.nc; c++)
+                dst[c] = lut[src[c * step]];
+        }
+    });
+}
+
+template<class T, class S>
+static void encode_buffer(const ArrayRGBT<T> &image, float gamma, const PixelBuffer &out)
+{
+    int step = out.planar ? 1 : out.channels;
+    parallel_bands(out.nr, [&](int color, int start_row, int end_row) {
+        for (int r = start_row; r < end_row; r++)
+            encode_samples(&image(r, 0, color), out.nc, gamma,
+                reinterpret_cast<S *>(static_cast<uint8 *>(out.data) + sample_offset(out, r, 0, color)), step);
+    });
+}
+
+template<class T>
+void ReflectionCorrector::correct(const PixelBuffer &in, int dpi, float gamma, const PixelBuffer *out) const
+{
+    const PixelBuffer &to = out ? *out : in;
+    check_buffer(in);
+    check_buffer(to);
+    if (to.nr != in.nr || to.nc != in.nc)
+        throw "Output PixelBuffer is not the same size as the input";
+    ArrayRGBT<T> image(in.nr, in.nc, dpi, in.bits == 16, gamma);
+    {
+        TraceSpan span("decode", 3.0 * sizeof(T) * image.v[0].size());
+        if (in.bits == 16)
+            decode_buffer<T, uint16>(in, gamma, image);
+        else
+            decode_buffer<T, uint8>(in, gamma, image);
+    }
+    correct(image);
+    TraceSpan span("encode", 3.0 * sizeof(T) * image.v[0].size());
+    if (to.bits == 16)
+        encode_buffer<T, uint16>(image, gamma, to);
+    else
+        encode_buffer<T, uint8>(image, gamma, to);
+}
+
+template void ReflectionCorrector::correct(ArrayRGBT<float> &) const;
+template void ReflectionCorrector::correct(ArrayRGBT<uint16> &) const;
+template void ReflectionCorrector::correct(ArrayRGBT<half> &) const;
+template void ReflectionCorrector::correct<float>(const PixelBuffer &, int, float, const PixelBuffer *) const;
+template void ReflectionCorrector::correct<uint16>(const PixelBuffer &, int, float, const PixelBuffer *) const;
+template void ReflectionCorrector::correct<half>(const PixelBuffer &, int, float, const PixelBuffer *) const;
+template void ReflectionCorrector::adjust_to_white(ArrayRGBT<float> &, const SampleHistogram &) const;
+template void ReflectionCorrector::adjust_to_white(ArrayRGBT<uint16> &, const SampleHistogram &) const;
+template void ReflectionCorrector::adjust_to_white(ArrayRGBT<half> &, const SampleHistogram &) const;
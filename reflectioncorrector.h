@@ -0,0 +1,106 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef REFLECTIONCORRECTOR_H
+#define REFLECTIONCORRECTOR_H
+
+// The correction as a library for images that are already in memory, either as
+// ArrayRGBT<T> or as the caller's own 8 or 16 bit RGB buffers, without tif files.
+// One ReflectionCorrector serves any number of dpis and calling threads. Each dpi's
+// kernel is built, or read from the kernel cache, once by the first image at that dpi.
+// Stages use the shared thread pool, which runs one parallel stage at a time, so
+// concurrent calls are safe and share the cores.
+
+#include "tiffresults.h"
+#include "reflconvolve.h"
+#include "applycorrection.h"
+#include "kernelcache.h"
+#include <cstddef>
+#include <map>
+#include <mutex>
+
+// Same meanings and defaults as the command line options in parentheses
+struct CorrectorOptions {
+    float edge_reflectance = .85f;              // ave reflectance outside the scanned area (-S)
+    bool simulate = false;                      // add reflected light instead of removing it (-R)
+    bool no_gain_restore = false;               // don't restore gain after the subtraction (-N)
+    bool adjust_to_white = false;               // scale so the brightest .01% are white (-W)
+    ConvolveMode convolve = ConvolveMode::direct;   // (-C)
+    float svd_max_error = .0001f;               // (-E)
+    string kernel_cache_dir;                    // (-K) empty for no on disk cache
+};
+
+// Reflection kernel for one scan dpi plus whatever the convolve engine precomputes from it
+struct Kernel {
+    ArrayRGB refl_area;
+    int x2, x3;                 // number of times DPI divisable by 2 and 3
+    KernelSpectrum spectrum;    // ConvolveMode::fft
+    SeparableKernel separable;  // ConvolveMode::svd
+    MultiresKernel multires;    // ConvolveMode::multires, refl_area is one reduction step finer
+};
+
+// Caller owned RGB pixels, 8 or 16 bits per sample.
+// Interleaved: sample s of pixel c in row r is at data + r*row_stride + (c*channels + s) samples,
+// samples past the first 3 (alpha) are left alone. Planar: color s of pixel c in row r is
+// at data + s*plane_stride + r*row_stride + c samples. Strides are in bytes.
+struct PixelBuffer {
+    void *data = nullptr;
+    int nr = 0, nc = 0;
+    int bits = 16;
+    bool planar = false;
+    int channels = 3;               // interleaved samples per pixel
+    ptrdiff_t row_stride = 0;       // 0: rows are packed
+    ptrdiff_t plane_stride = 0;     // 0: planes are packed
+};
+
+class ReflectionCorrector {
+public:
+    explicit ReflectionCorrector(const CorrectorOptions &options = CorrectorOptions());
+    const CorrectorOptions &options() const { return opts; }
+
+    // Linear [0:1] image with its dpi set, corrected in place
+    template<class T> void correct(ArrayRGBT<T> &image) const;
+
+    // Caller's pixels, gamma encoded with gamma (1.7 for Epson raw scans, 2.2 for Adobe RGB).
+    // The result is written to out, which may have other bits, layout and strides, or back
+    // into in when out is null. T is the storage of the working image (pixelstorage.h).
+    template<class T = float>
+    void correct(const PixelBuffer &in, int dpi, float gamma, const PixelBuffer *out = nullptr) const;
+
+    // The stages correct() runs, for callers that save or time the intermediate results
+    const Kernel &kernel(int dpi) const;
+    Decimator decimator(const Kernel &kernel, int nr, int nc, int dpi) const;  // to the kernel dpi, with 1" surround
+    ArrayRGB reflected_light(const ArrayRGB &image_reduced, const Kernel &kernel) const;
+    // for columns [first_col, first_col + nc) of an image scanned at dpi
+    CorrectionApplier applier(const ArrayRGB &correction, const Kernel &kernel, int dpi, int nc, int first_col = 0) const;
+    float gain() const;         // applied after the subtraction, or addition with -R
+    template<class T> void adjust_to_white(ArrayRGBT<T> &image, const SampleHistogram &histogram) const;
+
+private:
+    CorrectorOptions opts;
+    KernelCache cache;
+    mutable std::mutex m;
+    mutable std::map<int, Kernel> kernels;      // by scan dpi, nodes never move
+};
+
+#endif
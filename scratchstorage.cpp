@@ -0,0 +1,238 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "scratchstorage.h"
+#include "trace.h"
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <new>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    const size_t min_mapped_bytes = size_t(64) << 20;     // smaller planes, strips and reduced images stay on the heap
+    const size_t min_pooled_bytes = size_t(1) << 18;      // smaller blocks are left to the heap allocator
+
+    struct Mapping {
+        size_t bytes;
+#ifdef _WIN32
+        HANDLE file;
+#endif
+    };
+    std::string dir;
+    std::mutex m;
+    std::map<void *, Mapping> mappings;
+    std::multimap<size_t, void *> pool;     // freed blocks by size
+    size_t live = 0;            // bytes of poolable blocks in use
+    size_t pooled = 0;          // bytes of blocks in the pool
+    size_t high_water = 0;      // most bytes of poolable blocks ever in use
+    std::map<std::string, AllocationStats> stats;
+
+    // Maps a new, already deleted, file of bytes in dir
+    void *map_file(size_t bytes, Mapping &mapping)
+    {
+        mapping.bytes = bytes;
+#ifdef _WIN32
+        char path[MAX_PATH];
+        if (GetTempFileNameA(dir.c_str(), "rfx", 0, path) == 0)
+            return nullptr;
+        mapping.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (mapping.file == INVALID_HANDLE_VALUE)
+            return nullptr;
+        HANDLE section = CreateFileMappingA(mapping.file, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(uint64_t(bytes) >> 32), static_cast<DWORD>(bytes), nullptr);
+        void *p = section ? MapViewOfFile(section, FILE_MAP_ALL_ACCESS, 0, 0, bytes) : nullptr;
+        if (section)
+            CloseHandle(section);       // the view keeps it
+        if (p == nullptr)
+            CloseHandle(mapping.file);
+        return p;
+#else
+        std::string path = dir + "/reflfix-XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd < 0)
+            return nullptr;
+        unlink(path.c_str());
+        // reserve the blocks now, a full disk is an error here instead of a SIGBUS later
+#ifdef __linux__
+        bool sized = posix_fallocate(fd, 0, static_cast<off_t>(bytes)) == 0;
+#else
+        bool sized = ftruncate(fd, static_cast<off_t>(bytes)) == 0;
+#endif
+        void *p = sized ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);                      // the mapping keeps the file
+        if (p == MAP_FAILED)
+            return nullptr;
+        madvise(p, bytes, MADV_SEQUENTIAL);
+        return p;
+#endif
+    }
+
+    void unmap_file(void *p, const Mapping &mapping)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(p);
+        CloseHandle(mapping.file);
+#else
+        munmap(p, mapping.bytes);
+#endif
+    }
+}
+
+void set_scratch_dir(const std::string &scratch_dir)
+{
+    dir = scratch_dir;
+    if (dir.empty())
+        return;
+    Mapping test;
+    void *p = map_file(1 << 16, test);
+    if (p == nullptr)
+        throw "--scratch-dir dir:   could not create a scratch file in dir\n";
+    unmap_file(p, test);
+}
+
+// A new block from the heap or a scratch file
+static void *new_block(size_t bytes)
+{
+    if (!dir.empty() && bytes >= min_mapped_bytes)
+    {
+        Mapping mapping;
+        void *p = map_file(bytes, mapping);
+        if (p == nullptr)
+            throw "Could not create scratch file, is --scratch-dir full?";
+        std::lock_guard<std::mutex> lock(m);
+        mappings[p] = mapping;
+        return p;
+    }
+    return ::operator new(bytes);
+}
+
+// Returns a block to the heap or unmaps its scratch file
+static void release_block(void *p, size_t bytes)
+{
+    if (bytes >= min_mapped_bytes)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        auto found = mappings.find(p);
+        if (found != mappings.end())
+        {
+            Mapping mapping = found->second;
+            mappings.erase(found);
+            lock.unlock();
+            unmap_file(p, mapping);
+            return;
+        }
+    }
+    ::operator delete(p);
+}
+
+// Blocks of the size of one freed earlier come from the pool, without new pages to
+// fault in. When a new block is needed, pooled blocks are released first as far as
+// needed to keep the blocks in use plus the pool within the peak ever in use, so the
+// pool never raises the process's peak memory. A new block only counts as in use once it
+// exists, so a failed allocation leaves the bookkeeping as it was.
+void *scratch_allocate(size_t bytes)
+{
+    const char *stage = trace_current();
+    std::vector<std::pair<size_t, void *>> evicted;
+    bool poolable = bytes >= min_pooled_bytes;
+    {
+        std::lock_guard<std::mutex> lock(m);
+        AllocationStats &s = stats[stage ? stage : ""];
+        s.count++;
+        s.bytes += bytes;
+        if (poolable)
+        {
+            auto found = pool.find(bytes);
+            if (found != pool.end())
+            {
+                void *p = found->second;
+                pool.erase(found);
+                pooled -= bytes;
+                live += bytes;
+                high_water = std::max(high_water, live);
+                s.reused++;
+                return p;
+            }
+            size_t in_use = live + bytes;
+            while (!pool.empty() && in_use + pooled > std::max(high_water, in_use))
+            {
+                auto largest = std::prev(pool.end());
+                evicted.push_back(*largest);
+                pooled -= largest->first;
+                pool.erase(largest);
+            }
+        }
+    }
+    for (auto &block : evicted)
+        release_block(block.second, block.first);
+    void *p = new_block(bytes);
+    if (poolable)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        live += bytes;
+        high_water = std::max(high_water, live);
+    }
+    return p;
+}
+
+void scratch_deallocate(void *p, size_t bytes)
+{
+    if (bytes >= min_pooled_bytes)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        live -= bytes;
+        pool.emplace(bytes, p);
+        pooled += bytes;
+        return;
+    }
+    ::operator delete(p);
+}
+
+void release_pool()
+{
+    std::multimap<size_t, void *> blocks;
+    {
+        std::lock_guard<std::mutex> lock(m);
+        blocks.swap(pool);
+        pooled = 0;
+    }
+    for (auto &block : blocks)
+        release_block(block.second, block.first);
+}
+
+std::vector<std::pair<std::string, AllocationStats>> allocation_stats()
+{
+    std::lock_guard<std::mutex> lock(m);
+    return std::vector<std::pair<std::string, AllocationStats>>(stats.begin(), stats.end());
+}
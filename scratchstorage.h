@@ -0,0 +1,73 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef SCRATCHSTORAGE_H
+#define SCRATCHSTORAGE_H
+
+// Storage for image planes and large scratch buffers.
+//
+// Freed blocks of 256KB and more are pooled and handed out again for the next request of
+// the same size, across stages and across the files of a batch, so the stages don't pay
+// for faulting in and zeroing fresh pages from the OS each time.
+// Allocations are counted by the trace span (stage) open when they are made, on the
+// thread pool workers too. Spans are tracked with or without -J.
+//
+// Optional out of core storage (--scratch-dir dir). With a scratch directory set, planes
+// of 64MB and more are memory mapped temporary files instead of heap memory, so the OS
+// can write them out and drop them under memory pressure rather than the process
+// running out of memory. The files are removed as soon as they are
+// created and are gone when the planes are freed or the process ends. Mappings are
+// advised sequential since the stages walk each plane in row order.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+void set_scratch_dir(const std::string &dir);  // "" keeps planes on the heap, throws if dir is not writable
+void *scratch_allocate(size_t bytes);           // a mapped file if a scratch dir is set and bytes is large, else heap
+void scratch_deallocate(void *p, size_t bytes);    // pools blocks of 256KB and more
+void release_pool();                            // frees the pooled blocks
+
+struct AllocationStats {
+    uint64_t count = 0;         // allocations
+    uint64_t bytes = 0;         // bytes allocated
+    uint64_t reused = 0;        // allocations served from the pool
+};
+// By stage name, "" for allocations made outside any trace span
+std::vector<std::pair<std::string, AllocationStats>> allocation_stats();
+
+// Allocator for the ArrayRGBT planes and other large buffers
+template<class T>
+struct PlaneAllocator {
+    using value_type = T;
+    PlaneAllocator() = default;
+    template<class U> PlaneAllocator(const PlaneAllocator<U> &) {}
+    T *allocate(size_t n) { return static_cast<T *>(scratch_allocate(n * sizeof(T))); }
+    void deallocate(T *p, size_t n) { scratch_deallocate(p, n * sizeof(T)); }
+};
+template<class T, class U> bool operator==(const PlaneAllocator<T> &, const PlaneAllocator<U> &) { return true; }
+template<class T, class U> bool operator!=(const PlaneAllocator<T> &, const PlaneAllocator<U> &) { return false; }
+
+#endif
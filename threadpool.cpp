@@ -0,0 +1,185 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "threadpool.h"
+#include "trace.h"
+
+static thread_local bool in_pool_task = false;     // set while running a task or a parallel_for
+
+ThreadPool::ThreadPool(int nthreads)
+{
+    nthreads = std::max(1, nthreads);
+    for (int i = 0; i < nthreads; i++)
+        queues.push_back(std::make_unique<Queue>());
+    for (int i = 0; i < nthreads - 1; i++)
+        threads.emplace_back(&ThreadPool::worker, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(m);
+        quit = true;
+    }
+    start_cv.notify_all();
+    for (auto &t : threads)
+        t.join();
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int)> &f)
+{
+    if (n <= 0)
+        return;
+    if (size() == 1 || n == 1 || in_pool_task)
+    {
+        for (int i = 0; i < n; i++)
+            f(i);
+        return;
+    }
+    std::lock_guard<std::mutex> run_lock(run_mutex);
+    in_pool_task = true;
+    error = nullptr;
+    remaining = n;
+    job = &f;
+    job_name = trace_current();
+    // deal contiguous shares so neighboring bands stay on one worker unless stolen
+    int nq = size();
+    for (int w = 0; w < nq; w++)
+    {
+        std::lock_guard<std::mutex> lk(queues[w]->m);
+        for (int i = int(static_cast<long long>(n) * w / nq); i < int(static_cast<long long>(n) * (w + 1) / nq); i++)
+            queues[w]->q.push_back(i);
+    }
+    {
+        std::lock_guard<std::mutex> lk(m);
+        generation++;
+    }
+    start_cv.notify_all();
+    work(nq - 1);
+    {
+        std::unique_lock<std::mutex> lk(m);
+        done_cv.wait(lk, [this] { return remaining == 0; });
+        job = nullptr;
+    }
+    in_pool_task = false;
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void ThreadPool::worker(int id)
+{
+    in_pool_task = true;
+    unsigned long long seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lk(m);
+            start_cv.wait(lk, [&] { return quit || generation != seen; });
+            if (quit)
+                return;
+            seen = generation;
+        }
+        work(id);
+    }
+}
+
+void ThreadPool::work(int id)
+{
+    int task;
+    const char *name = nullptr;     // read after the first pop, which orders it after parallel_for set it
+    const char *outer = nullptr;
+    double start = 0;
+    int done = 0;
+    while (pop(id, task) || steal(id, task))
+    {
+        if (done++ == 0)
+        {
+            name = job_name;
+            outer = trace_set_current(name);
+            start = tracing() ? trace_now() : 0;
+        }
+        try {
+            (*job)(task);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lk(m);
+            if (!error)
+                error = std::current_exception();
+        }
+        if (--remaining == 0)
+        {
+            std::lock_guard<std::mutex> lk(m);
+            done_cv.notify_all();
+        }
+    }
+    if (!done)
+        return;
+    trace_set_current(outer);
+    if (name)
+        trace_event(name, start, trace_now());
+}
+
+bool ThreadPool::pop(int id, int &task)
+{
+    Queue &q = *queues[id];
+    std::lock_guard<std::mutex> lk(q.m);
+    if (q.q.empty())
+        return false;
+    task = q.q.front();
+    q.q.pop_front();
+    return true;
+}
+
+bool ThreadPool::steal(int id, int &task)
+{
+    for (int i = 1; i < size(); i++)
+    {
+        Queue &q = *queues[(id + i) % size()];
+        std::lock_guard<std::mutex> lk(q.m);
+        if (!q.q.empty())
+        {
+            task = q.q.back();
+            q.q.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static int requested_threads = 0;
+
+void set_thread_count(int n)
+{
+    requested_threads = n;
+}
+
+ThreadPool &thread_pool()
+{
+#ifdef DISABLE_ASYNC_THREADS
+    static ThreadPool pool(1);
+#else
+    static ThreadPool pool(requested_threads > 0 ? requested_threads :
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency())));
+#endif
+    return pool;
+}
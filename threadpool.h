@@ -0,0 +1,104 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Shared worker pool for the image stages. Work is split into independent tasks
+// (normally row bands x colors) that each write their own part of the output, so
+// results are bit identical to running the same tasks serially.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//#define DISABLE_ASYNC_THREADS      // run every stage on the calling thread
+
+class ThreadPool {
+public:
+    explicit ThreadPool(int nthreads);      // nthreads includes the calling thread
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    int size() const { return static_cast<int>(queues.size()); }
+
+    // Runs f(i) for i in [0, n) and returns when all are done. Each worker starts on its
+    // own contiguous share of the indices and, when that runs out, steals from the far
+    // end of another worker's share. Calls from inside a task run serially.
+    // The first exception thrown by a task is rethrown here.
+    // Jobs run with the caller's open span as their thread's current stage, and when
+    // tracing each thread records a span named after it.
+    void parallel_for(int n, const std::function<void(int)> &f);
+
+private:
+    struct Queue {
+        std::mutex m;
+        std::deque<int> q;
+    };
+    void worker(int id);
+    void work(int id);
+    bool pop(int id, int &task);
+    bool steal(int id, int &task);
+
+    std::vector<std::unique_ptr<Queue>> queues;     // one per worker, the last is the caller's
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable start_cv, done_cv;
+    const std::function<void(int)> *job = nullptr;
+    const char *job_name = nullptr;                 // trace span (stage) of the caller
+    unsigned long long generation = 0;
+    std::atomic<int> remaining{ 0 };
+    bool quit = false;
+    std::exception_ptr error;
+    std::mutex run_mutex;                           // one parallel_for at a time
+};
+
+// Shared pool. Size is set by set_thread_count() before first use, default is
+// std::thread::hardware_concurrency()
+void set_thread_count(int n);
+ThreadPool &thread_pool();
+
+
+// Runs f(color, start_row, end_row) over row bands of [0, nr) for each of colors channels
+template<class F>
+void parallel_bands(int nr, F f, int colors = 3)
+{
+    ThreadPool &pool = thread_pool();
+    if (nr <= 0)
+        return;
+    int band = std::max(1, nr / (4 * pool.size()));     // ~4 bands per worker per color
+    int nbands = (nr + band - 1) / band;
+    pool.parallel_for(nbands * colors, [&](int i) {
+        int color = i / nbands;
+        int b = i % nbands;
+        f(color, b * band, std::min(nr, (b + 1) * band));
+    });
+}
+
+#endif
@@ -1,437 +1,1118 @@
-/*
-Copyright (c) <2018> <doug gray>
-
-Permission is hereby granted, free of charge, to any person obtaining a copy
-of this software and associated documentation files (the "Software"), to deal
-in the Software without restriction, including without limitation the rights
-to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
-copies of the Software, and to permit persons to whom the Software is
-furnished to do so, subject to the following conditions:
-
-The above copyright notice and this permission notice shall be included in all
-copies or substantial portions of the Software.
-
-THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
-AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
-LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-SOFTWARE.
-*/
-
-#include "tiffresults.h"
-#include <memory>
-#include <array>
-#include <string>
-#include <fstream>
-#include <iostream>
-#include <algorithm>
-
-
-
-// Reads a tiff file and returns image in linear space (gamma=1) scaled 0-1
-ArrayRGB TiffRead(const char *filename, float gamma)
-{
-    ArrayRGB rgb;               // ArrayRGB to be returned
-    uint32 prof_size = 0;       // size of byte arrray for storing profile if present
-    uint8 *prof_data = nullptr; // ptr to byte array
-    uint16 bits;                // image was from 8 or 16 bit tiff
-    uint32 height;              // image pixe sizes
-    uint32 width;
-    uint32 size;                // width*height
-    uint16 planarconfig;        // pixel tiff storage orientation
-    float local_dpi;
-
-    vector<uint32> image;
-    TIFF *tif;
-
-    tif = TIFFOpen(filename, "r");
-    if (tif == 0)
-    {
-        return rgb;
-    }
-    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
-    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
-    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
-    TIFFGetField(tif, TIFFTAG_XRESOLUTION, &local_dpi);       // assume Xand Y the same
-    TIFFGetField(tif, TIFFTAG_ICCPROFILE, &prof_size, &prof_data);
-    TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &planarconfig);
-    if (prof_size!=0)
-    {
-        rgb.profile.resize(prof_size);
-        memcpy(rgb.profile.data(), prof_data, prof_size);
-    }
-
-    size = width*height;
-    rgb.resize(height, width);
-    rgb.nc = width;
-    rgb.nr = height;
-    rgb.dpi = (int)local_dpi;
-    rgb.gamma = gamma;
-    if (planarconfig != PLANARCONFIG_CONTIG || bits == 8) {
-        if (bits == 16)
-            std::cout << "16 bit tif file not recognized, reverting to 8 bit read.\n";
-        rgb.from_16bits = false;
-        image.resize(height*width);
-        int istatus = TIFFReadRGBAImage(tif, width, height, image.data());
-        if (istatus==1) {
-            for (uint32 c = 0; c < width; c++)
-            {
-                for (uint32 r = 0; r < height; r++)
-                {
-                    int yt = height-r-1;
-                    //auto z0 = this->operator[](yt)[c];
-                    uint32 z0 = image[yt*width+c];
-                    rgb(r, c, 0) = pow(static_cast<float>(z0 & 0xff)/255, gamma);
-                    rgb(r, c, 1) = pow(static_cast<float>((z0>>8) & 0xff)/255, gamma);
-                    rgb(r, c, 2) = pow(static_cast<float>((z0>>16) & 0xff)/255, gamma);
-                }
-            }
-        }
-        else
-            throw "Bad TIFFReadRGBAImage";
-    }
-    else
-    {
-        rgb.from_16bits = true;
-        uint32 row, col;
-        uint16 config, nsamples;
-
-        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
-        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
-        TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &config);
-        TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &nsamples);
-        vector<uint16_t> bufs(TIFFScanlineSize(tif));
-        if (config == PLANARCONFIG_CONTIG) {
-            for (row = 0; row < height; row++)
-            {
-                tmsize_t count = TIFFReadScanline(tif, bufs.data(), row);
-                for (col = 0; col < width; col++)
-                {
-                    rgb(row, col, 0) = pow(1.0f*bufs[col*nsamples + 0]/65535, gamma);
-                    rgb(row, col, 1) = pow(1.0f*bufs[col*nsamples + 1] / 65535, gamma);
-                    rgb(row, col, 2) = pow(1.0f*bufs[col*nsamples + 2] / 65535, gamma);
-                }
-            }
-        }
-        else
-            throw "16 bit file type not supported";
-    }
-    return rgb;
-}
-
-void attach_profile(const std::string & profile, TIFF * out, const ArrayRGB & rgb)
-{
-    // If profile is requested, read the profile file and store it in tiff image.
-    if (profile != "")
-    {
-        ifstream profilestream(profile, ios::binary);
-        if (profilestream.fail())
-            throw "File could not be opened";
-        vector<char>  profileimage;
-        profilestream.seekg(0, ios_base::end);
-        auto size = profilestream.tellg();
-        profilestream.seekg(0, ios_base::beg);
-        profileimage.resize(size);
-        profilestream.read(profileimage.data(), size);
-        TIFFSetField(out, TIFFTAG_ICCPROFILE, (int)size, profileimage.data());
-    }
-    // rgb image already has a profile save it to new tiff
-    else if (rgb.profile.size() != 0)
-    {
-        TIFFSetField(out, TIFFTAG_ICCPROFILE, (uint32)(rgb.profile.size()), rgb.profile.data());
-    }
-}
-
-void TiffWrite(const char *file, const ArrayRGB &rgb, const string &profile, bool adj_following_cells)
-{
-    float gamma = rgb.gamma;
-    int sampleperpixel=3;
-    TIFF *out = TIFFOpen(file, "w");
-    TIFFSetField(out, TIFFTAG_IMAGEWIDTH, rgb.nc);  // set the width of the image
-    TIFFSetField(out, TIFFTAG_IMAGELENGTH, rgb.nr);    // set the height of the image
-    TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, sampleperpixel);   // set number of channels per pixel
-    TIFFSetField(out, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);    // set the origin of the image.
-                                                                    //   Some other essential fields to set that you do not have to understand for now.
-    TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-    TIFFSetField(out, TIFFTAG_XRESOLUTION, (float)rgb.dpi);
-    TIFFSetField(out, TIFFTAG_YRESOLUTION, (float)rgb.dpi);
-    attach_profile(profile, out, rgb);
-    if (!rgb.from_16bits)
-    {
-        TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 8);    // set the size of the channels
-        tsize_t linebytes = sampleperpixel * rgb.nc;
-        vector<unsigned char> buf(linebytes);
-
-        // We set the strip size of the file to be size of one row of pixels
-        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, rgb.nc*sampleperpixel));
-        vector<array<uint8, 3>> image(rgb.nr*rgb.nc);
-        //unique_ptr<uint32[]> image(new uint32[rgb.nr*rgb.nc]);
-        auto igamma = 1 / gamma;
-        auto one_channel_to_8 = [](const vector<float> &image_ch, int cols, float inv_gamma) {
-            float resid = 0;
-            vector<uint8> ret(image_ch.size());
-            for (int i = 0; i < ret.size(); i++)
-            {
-                if (i % cols == 0)    // No offset at start of each row
-                    resid = 0;
-                float tmp = 255 * pow(image_ch[i], inv_gamma);
-                if (tmp > 255) tmp = 255;
-                if (tmp < 0) tmp = 0;
-                uint8 tmpr = static_cast<uint8>(tmp + .5);
-                resid += tmp - tmpr;
-                if (resid > .5 && tmpr < 255)
-                {
-                    resid -= 1;
-                    tmpr++;
-                }
-                else if (resid < -.5)
-                {
-                    resid += 1;
-                    tmpr--;
-                }
-                ret[i] = tmpr;
-            }
-            return ret;
-        };
-        vector<uint8> red = one_channel_to_8(rgb.v[0], rgb.nc, igamma);
-        vector<uint8> green = one_channel_to_8(rgb.v[1], rgb.nc, igamma);
-        vector<uint8> blue = one_channel_to_8(rgb.v[2], rgb.nc, igamma);
-
-        for (int r = 0; r < rgb.nr; r++)
-            for (int c = 0; c < rgb.nc; c++)
-            {
-                int offset = r * rgb.nc + c;
-                //image[offset] = red[offset] | green[offset] << 8 | blue[offset] << 16 | 0xff000000;
-                image[offset][0] = red[offset];
-                image[offset][1] = green[offset];
-                image[offset][2] = blue[offset];
-            }
-
-        //Now writing image to the file one strip at a time
-        for (int row = 0; row < rgb.nr; row++)
-        {
-            //memcpy(buf, &image[row*linebytes/sizeof(uint32)], linebytes);    // check the index here, and figure out why not using h*linebytes
-            memcpy(buf.data(), &image[row*rgb.nc], linebytes);    // check the index here, and figure out why not using h*linebytes
-            if (TIFFWriteScanline(out, buf.data(), row, 0) < 0)
-                break;
-        }
-        TIFFClose(out);
-    }
-    else
-    {
-        TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 16);    // set the size of the channels
-        // 16  bit write
-        vector<array<uint16, 3>> buf(rgb.nc);
-        // We set the strip size of the file to be size of one row of pixels
-        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, rgb.nc*sampleperpixel));
-
-        auto igamma = 1 / gamma;
-
-        for (int r = 0; r < rgb.nr; r++)
-        {
-            for (int c = 0; c < rgb.nc; c++)
-            {
-                for (int color = 0; color < 3; color++)
-                {
-                    buf[c][color] = static_cast<uint16>(pow(std::clamp(rgb(r, c, color), 0.f, 1.f), igamma) * 65535);
-                }
-            }
-            if (TIFFWriteScanline(out, buf.data(), r, 0) < 0)
-                throw "Error writing tif";
-        }
-        TIFFClose(out);
-    }
-}
-
-
-
-void ArrayRGB::fill(float red, float green, float blue) {
-    for (auto& x:v[0]) { x = red; }
-    for (auto& x:v[1]) { x = green; }
-    for (auto& x:v[2]) { x = blue; }
-}
-
-void ArrayRGB::copy(const ArrayRGB &from, int offsetx, int offsety)
-{
-    //assert(from.nr + offsetx < nr);
-    //assert(from.nc + offsety < nc);
-    for (int color = 0; color < 3; color++)
-        for (int x = 0; x < from.nr; x++)
-            for (int y = 0; y < from.nc; y++)
-                (*this)(x+offsetx, y+offsety, color) = from(x, y, color);
-}
-
-ArrayRGB ArrayRGB::subArray(int rs, int re, int cs, int ce)
-{
-    assert(rs <= re && re < nr);
-    assert(cs <= ce && ce < nc);
-    ArrayRGB s(re-rs+1, ce-cs+1);
-    for (int color = 0; color < 3; color++)
-        for (int r = rs; r <= re; r++)
-            for (int c = cs; c <= ce; c++)
-                s(r-rs, c-cs, color) = (*this)(r, c, color);
-    return s;
-}
-
-void ArrayRGB::copyColumn(int to, int from)
-{
-    for (int color = 0; color < 3; color++)
-        for (int r = 0; r < nr; r++)
-            (*this)(r, to, color) = (*this)(r, from, color);
-}
-
-void ArrayRGB::copyRow(int to, int from)
-{
-    for (int color = 0; color < 3; color++)
-        for (int c = 0; c < nc; c++)
-            (*this)(to, c, color) = (*this)(from, c, color);
-}
-
-array<float, 3> ArrayRGB::sum() {
-    array<float, 3> ret;
-    ret[0] = accumulate(v[0].cbegin(), v[0].cend(), 0.f);
-    ret[1] = accumulate(v[1].cbegin(), v[1].cend(), 0.f);
-    ret[2] = accumulate(v[2].cbegin(), v[2].cend(), 0.f);
-    return ret;
-}
-
-void ArrayRGB::scale(float factor)    // scale all array values by factor
-{
-    for (int i = 0; i < 3; i++)
-        for (auto &x:v[i])
-            x *= factor;
-}
-
-
-
-tuple<ArrayRGB,int,int> getReflArea(const int dpi, const int use_this_size_if_not_0)
-{
-    auto actual_dpi = !use_this_size_if_not_0 ? dpi : use_this_size_if_not_0;
-    float gain = 1;
-	int x2 = 0;
-	int x3 = 0;
-	if (!use_this_size_if_not_0)		// find smaller size for faster interpolation (normal usage)
-	{
-		while (actual_dpi >= 90 && actual_dpi % 3 == 0)
-		{
-			actual_dpi /= 3;
-			x3++;
-		}
-		while (actual_dpi >= 60 && actual_dpi % 2 == 0)
-		{
-			actual_dpi /= 2;
-			x2++;
-		}
-	}
-    gain = 400.f/actual_dpi;
-    int refl_size = (int)round(actual_dpi*2+1);
-    // reflection function based on 200 DPI
-    const float refl_fraction = .20f;
-    array<float, 6> fvc{ 1.361e-15f, -3.737e-12f, 4.042e-09f, -2.156e-06f, 0.0005713f, 0 };
-    array<float, 8> fhc{ 7.729e-20f,-1.842e-16f,1.793e-13f,-9.23e-11f,2.756e-08f,-5.168e-06f,0.0006892f,0 };
-    //fv = @(x) .9574*(1.361e-15*x.^5-3.737e-12*x.^4+4.042e-09*x.^3-2.156e-06*x.^2+0.0005713*x);
-    //fh = @(x) 7.729e-20*x.^7-1.842e-16*x.^6+1.793e-13*x.^5-9.23e-11*x.^4+2.756e-08*x.^3-5.168e-06*x.^2+0.0006892*x;
-    auto fv = [&fvc](float x) {
-        if (x > 400) x = 400;
-        float s = 0;
-        for (auto v: fvc) s = s*x+v;
-        return .9574f*s;
-    };
-    auto fh = [&fhc](float x) {
-        if (x > 400) x = 400;
-        float s = 0;
-        for (auto v: fhc) s = s*x+v;
-        return s;
-    };
-    auto fv0 = [](float x) {
-        if (x > 560) x = 560;
-        return -((((-8.72e-13f*x + 2.002e-9f)*x -1.674e-6f)*x + 0.0006124f)*x -0.0838040f);
-    };
-    ArrayRGB ret(2*actual_dpi+1, 2*actual_dpi+1, actual_dpi);
-    for (int i = 0; i < ret.nr; i++)
-    {
-        for (int ii = 0; ii < ret.nc; ii++)
-        {
-            // There are two algorithms for estimating the amout of light reflected.
-            // The first was from 6mm square, symetric patterns, the second from 4 pages of randomly distributed
-            // 3mm white/black squares. They are both quite good but the second is slightly better.
-            // The first one is remains, but is disabled.
-            if (false) {
-                float offset = (ret.nc-1)/2.0f;
-				float offx = i-offset;
-				float offy = ii-offset;
-                float dist = sqrt(1.7f*offx*offx + 1.5f*offy*offy);
-                float gain_total = gain*dist < 560 ? gain*dist : 560;
-                ret(i, ii, 0) = ret(i, ii, 1) = ret(i, ii, 2) = fv0(gain_total);
-            }
-            else
-            {
-				float p1, p2;
-				float offset = (ret.nc-1)/2.0f;
-				float offx = abs(gain*(i-offset)); if (offx > 400) offx = 400;
-				float offy = abs(gain*(ii-offset)); if (offy > 400) offy = 400;
-                float dist = sqrt(offx*offx + offy*offy+.0000001f); dist <= 400 ? dist: 400;
-                p1 = offx/(offx+offy+.00001f) * (.0838f - (.0838f/.0579f)*fv(1.1f*dist));    // 1.1 is tweak
-                p2 = offy/(offx+offy+.00001f) * (.0838f - (.0838f/.0579f)*fh(dist));
-				if (offx == 0 && offy == 0)
-					ret(i, ii, 0) = ret(i, ii, 1) = ret(i, ii, 2) = .0838f - (.0838f / .0579f)*fv(1.1f*dist);
-				else
-					ret(i, ii, 0) = ret(i, ii, 1) = ret(i, ii, 2) = p1+p2;
-            }
-        }
-    }
-    auto sum = ret.sum();
-    auto factor = refl_fraction/sum[0];
-    for (int c = 0; c < 3; c++)
-        for (int i = 0; i < ret.nr; i++)
-            for (int ii = 0; ii < ret.nc; ii++)
-                ret(i, ii, c) *= factor;
-    //auto check_sum = ret.sum();
-    //auto check_factor = refl_fraction/check_sum[0];
-    return std::make_tuple(ret, x2, x3);
-}
-
-
-//float & ArrayRGB::operator()(int r, int c, int color)
-//{
-//	return v[color][r*nc + c];
-//}
-//
-
-// Create interpolated re-reflected values from original
-// remove 1" surround and set DPI at reduced resolution
-ArrayRGB generate_reflected_light_estimate(const ArrayRGB& image_reduced, const ArrayRGB& refl_area)
-{
-	ArrayRGB image_correction = ArrayRGB(image_reduced.nr - 2 * image_reduced.dpi,
-		image_reduced.nc - 2 * image_reduced.dpi,
-		image_reduced.dpi,
-		image_reduced.from_16bits,
-		image_reduced.gamma
-	);
-
-	auto fix = [&image_reduced, &refl_area, &image_correction](int s_row, int e_row, int color) {
-		for (int i = s_row; i < e_row; i++)
-		{
-			for (int ii = 0; ii < image_reduced.nc - refl_area.nc + 1; ii++)
-			{
-				float sum = 0;
-				for (int j = 0; j < refl_area.nr; j++)
-				{
-					for (int jj = 0; jj < refl_area.nc; jj++)
-					{
-						sum += image_reduced(i + j, ii + jj, color)*refl_area(j, jj, color);
-					}
-				}
-				image_correction(i, ii, color) = sum;
-			}
-		}
-	};
-	auto c0 = async(launchType, fix, 0, image_reduced.nr - refl_area.nr + 1, 0);
-	auto c1 = async(launchType, fix, 0, image_reduced.nr - refl_area.nr + 1, 1);
-	auto c2 = async(launchType, fix, 0, image_reduced.nr - refl_area.nr + 1, 2);
-	c0.get(); c1.get(); c2.get();
-	return image_correction;
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "tiffresults.h"
+#include "trace.h"
+#include <memory>
+#include <array>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <map>
+#include <mutex>
+#include <cstdio>
+#include <type_traits>
+
+
+
+// Table of gamma decoded values for every 8 or 16 bit code. Built once per (bits, gamma)
+// with the same float arithmetic the per sample pow() calls used, so values are identical.
+const vector<float> &decode_table(int bits, float gamma)
+{
+    static std::mutex m;
+    static std::map<std::pair<int, float>, vector<float>> tables;
+    std::lock_guard<std::mutex> lock(m);
+    auto &lut = tables[{bits, gamma}];
+    if (lut.empty())
+    {
+        lut.resize(size_t(1) << bits);
+        for (size_t v = 0; v < lut.size(); v++)
+            lut[v] = bits == 16 ? pow(1.0f*static_cast<uint16>(v)/65535, gamma)
+                                : pow(static_cast<float>(v)/255, gamma);
+    }
+    return lut;
+}
+
+// decode_table() in the storage type of ArrayRGBT<T>, converted holds it if T isn't float
+template<class T>
+static const T *storage_table(int bits, float gamma, vector<T> &converted)
+{
+    const vector<float> &table = decode_table(bits, gamma);
+    if constexpr (std::is_same_v<T, float>)
+        return table.data();
+    else
+    {
+        converted.resize(table.size());
+        for (size_t i = 0; i < table.size(); i++)
+            converted[i] = from_float<T>(table[i]);
+        return converted.data();
+    }
+}
+
+// Decodes a contiguous 8 (S=uint8) or 16 (S=uint16) bit tif by strips or tiles spread over
+// the thread pool. libtiff handles are not thread safe so each task opens its own and decodes
+// a run of strips (or tiles) with TIFFReadEncodedStrip/Tile, converting each straight into rgb.
+template<class S, class T>
+static void read_contig(const char *filename, TIFF *tif, ArrayRGBT<T> &rgb, int nsamples, const T *lut)
+{
+    bool tiled = TIFFIsTiled(tif) != 0;
+    uint32 tw = rgb.nc, th = 0;
+    if (tiled)
+    {
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+    }
+    else
+    {
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &th);
+        th = std::min(th, uint32(rgb.nr));
+    }
+    const int across = (rgb.nc + tw - 1) / tw;
+    const int nchunks = tiled ? TIFFNumberOfTiles(tif) : TIFFNumberOfStrips(tif);
+    const tmsize_t chunk_size = tiled ? TIFFTileSize(tif) : TIFFStripSize(tif);
+    const int ntasks = thread_pool().size() == 1 ? 1 : std::min(nchunks, 4 * thread_pool().size());
+
+    thread_pool().parallel_for(ntasks, [&](int task) {
+        TIFF *t = ntasks == 1 ? tif : TIFFOpen(filename, "r");
+        if (t == 0)
+            throw "Could not open input tif";
+        std::unique_ptr<TIFF, void(*)(TIFF *)> close_t(t == tif ? nullptr : t, TIFFClose);
+        vector<S> buf(chunk_size / sizeof(S) + 1);
+        for (int chunk = int(static_cast<long long>(nchunks) * task / ntasks); chunk < int(static_cast<long long>(nchunks) * (task + 1) / ntasks); chunk++)
+        {
+            tmsize_t got = tiled ? TIFFReadEncodedTile(t, chunk, buf.data(), chunk_size)
+                                 : TIFFReadEncodedStrip(t, chunk, buf.data(), chunk_size);
+            if (got < 0)
+                throw "Error decoding tif";
+            int row0 = chunk / across * th;
+            int col0 = chunk % across * tw;
+            int rows = std::min(int(th), rgb.nr - row0);
+            int cols = std::min(int(tw), rgb.nc - col0);
+            for (int r = 0; r < rows; r++)
+            {
+                const S *src = &buf[size_t(r) * tw * nsamples];
+                T *red = &rgb(row0 + r, col0, 0), *green = &rgb(row0 + r, col0, 1), *blue = &rgb(row0 + r, col0, 2);
+                for (int c = 0; c < cols; c++)
+                {
+                    red[c] = lut[src[c*nsamples + 0]];
+                    green[c] = lut[src[c*nsamples + 1]];
+                    blue[c] = lut[src[c*nsamples + 2]];
+                }
+            }
+        }
+    });
+}
+
+// Reads a tiff file and returns image in linear space (gamma=1) scaled 0-1
+template<class T>
+ArrayRGBT<T> TiffRead(const char *filename, float gamma)
+{
+    ArrayRGBT<T> rgb;           // ArrayRGB to be returned
+    TraceSpan span("decode");
+    uint32 prof_size = 0;       // size of byte arrray for storing profile if present
+    uint8 *prof_data = nullptr; // ptr to byte array
+    uint16 bits;                // image was from 8 or 16 bit tiff
+    uint32 height;              // image pixe sizes
+    uint32 width;
+    uint32 size;                // width*height
+    uint16 planarconfig;        // pixel tiff storage orientation
+    uint16 photometric = 0;
+    uint16 nsamples = 0;
+    float local_dpi;
+
+    vector<uint32> image;
+    vector<T> table;
+    TIFF *tif;
+
+    tif = TIFFOpen(filename, "r");
+    if (tif == 0)
+    {
+        return rgb;
+    }
+    std::unique_ptr<TIFF, void(*)(TIFF *)> close_tif(tif, TIFFClose);
+    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetField(tif, TIFFTAG_XRESOLUTION, &local_dpi);       // assume Xand Y the same
+    TIFFGetField(tif, TIFFTAG_ICCPROFILE, &prof_size, &prof_data);
+    TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &planarconfig);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+    TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &nsamples);
+    if (prof_size!=0)
+    {
+        rgb.profile.resize(prof_size);
+        memcpy(rgb.profile.data(), prof_data, prof_size);
+    }
+
+    size = width*height;
+    rgb.resize(height, width);
+    rgb.nc = width;
+    rgb.nr = height;
+    rgb.dpi = (int)local_dpi;
+    rgb.gamma = gamma;
+    if (bits == 8 && planarconfig == PLANARCONFIG_CONTIG && photometric == PHOTOMETRIC_RGB && nsamples >= 3)
+    {
+        rgb.from_16bits = false;
+        read_contig<uint8>(filename, tif, rgb, nsamples, storage_table(8, gamma, table));
+    }
+    else if (planarconfig != PLANARCONFIG_CONTIG || bits == 8) {
+        // palette, grayscale, YCbCr, separate planes etc. go through libtiff's RGBA conversion
+        if (bits == 16)
+            std::cout << "16 bit tif file not recognized, reverting to 8 bit read.\n";
+        rgb.from_16bits = false;
+        image.resize(height*width);
+        int istatus = TIFFReadRGBAImage(tif, width, height, image.data());
+        const T *lut = storage_table(8, gamma, table);
+        if (istatus==1) {
+            for (uint32 r = 0; r < height; r++)
+            {
+                const uint32 *src = &image[size_t(height-r-1)*width];     // RGBA rows are bottom up
+                for (uint32 c = 0; c < width; c++)
+                {
+                    uint32 z0 = src[c];
+                    rgb(r, c, 0) = lut[z0 & 0xff];
+                    rgb(r, c, 1) = lut[(z0>>8) & 0xff];
+                    rgb(r, c, 2) = lut[(z0>>16) & 0xff];
+                }
+            }
+        }
+        else
+            throw "Bad TIFFReadRGBAImage";
+    }
+    else
+    {
+        rgb.from_16bits = true;
+        read_contig<uint16>(filename, tif, rgb, nsamples, storage_table(16, gamma, table));
+    }
+    span.add_bytes(3.0 * sizeof(T) * rgb.v[0].size());
+    return rgb;
+}
+template ArrayRGBT<float> TiffRead<float>(const char *filename, float gamma);
+template ArrayRGBT<uint16> TiffRead<uint16>(const char *filename, float gamma);
+template ArrayRGBT<half> TiffRead<half>(const char *filename, float gamma);
+
+// Opens a contiguous 8 or 16 bit RGB tif for reading top to bottom
+// The layouts the constructor accepts
+static bool strip_layout(uint16 planarconfig, uint16 photometric, uint16 nsamples, uint16 bits)
+{
+    return planarconfig == PLANARCONFIG_CONTIG && photometric == PHOTOMETRIC_RGB && nsamples >= 3 && (bits == 8 || bits == 16);
+}
+
+bool TiffStripReader::can_read(const char *filename)
+{
+    TIFF *tif = TIFFOpen(filename, "rm");
+    if (tif == 0)
+        return false;
+    uint16 bits = 0, planarconfig = PLANARCONFIG_CONTIG, photometric = 0, nsamples = 3;
+    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &planarconfig);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+    TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &nsamples);
+    TIFFClose(tif);
+    return strip_layout(planarconfig, photometric, nsamples, bits);
+}
+
+TiffStripReader::TiffStripReader(const char *filename, float gamma) : gamma(gamma)
+{
+    uint32 prof_size = 0;
+    uint8 *prof_data = nullptr;
+    uint16 bits = 0, planarconfig = PLANARCONFIG_CONTIG, photometric = 0;
+    uint32 width = 0, height = 0;
+    float local_dpi = 0;
+
+    tif = TIFFOpen(filename, "rm");     // read(), not mapped, so only the current strip is resident
+    if (tif == 0)
+        throw "Could not open input tif";
+    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetField(tif, TIFFTAG_XRESOLUTION, &local_dpi);
+    TIFFGetField(tif, TIFFTAG_ICCPROFILE, &prof_size, &prof_data);
+    TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &planarconfig);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+    TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &nsamples);
+    if (!strip_layout(planarconfig, photometric, nsamples, bits))
+    {
+        TIFFClose(tif);
+        throw "Strip reads require a contiguous 8 or 16 bit RGB tif";
+    }
+    if (prof_size != 0)
+    {
+        profile.resize(prof_size);
+        memcpy(profile.data(), prof_data, prof_size);
+    }
+    nr = height;
+    nc = width;
+    dpi = (int)local_dpi;
+    from_16bits = bits == 16;
+    if (TIFFIsTiled(tif))
+    {
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tile_width);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &tile_length);
+        tile.resize(TIFFTileSize(tif));
+        buf.resize(size_t(tile_length) * TIFFScanlineSize(tif));
+    }
+    else
+        buf.resize(TIFFScanlineSize(tif));
+}
+
+TiffStripReader::~TiffStripReader()
+{
+    TIFFClose(tif);
+}
+
+// Returns the samples of row r. Tiled tifs are decoded a row of tiles at a time into buf.
+const uint8 *TiffStripReader::scanline(int r)
+{
+    size_t line = buf.size() / std::max(tile_length, uint32(1));
+    if (tile_length == 0)
+    {
+        if (TIFFReadScanline(tif, buf.data(), r) < 0)
+            throw "Error reading tif";
+        return buf.data();
+    }
+    int first = r / tile_length * tile_length;
+    if (first != tile_row)
+    {
+        size_t pixel = line / nc;
+        int rows = std::min(int(tile_length), nr - first);
+        for (uint32 c0 = 0; c0 < uint32(nc); c0 += tile_width)
+        {
+            if (TIFFReadEncodedTile(tif, TIFFComputeTile(tif, c0, first, 0, 0), tile.data(), tile.size()) < 0)
+                throw "Error reading tif";
+            size_t cols = std::min(tile_width, nc - c0) * pixel;
+            for (int i = 0; i < rows; i++)
+                memcpy(&buf[i * line + c0 * pixel], &tile[i * tile_width * pixel], cols);
+        }
+        tile_row = first;
+    }
+    return &buf[(r - first) * line];
+}
+
+// Returns the next nrows rows, fewer at the bottom of the image
+ArrayRGB TiffStripReader::read(int nrows)
+{
+    nrows = std::min(nrows, nr - row);
+    TraceSpan span("decode", 12.0 * nrows * nc);
+    ArrayRGB rgb(nrows, nc, dpi, from_16bits, gamma);
+    const float *lut = decode_table(from_16bits ? 16 : 8, gamma).data();
+    for (int r = 0; r < nrows; r++, row++)
+    {
+        const uint8 *line = scanline(row);
+        if (from_16bits)
+        {
+            const uint16 *bufs = reinterpret_cast<const uint16 *>(line);
+            for (int col = 0; col < nc; col++)
+            {
+                rgb(r, col, 0) = lut[bufs[col*nsamples + 0]];
+                rgb(r, col, 1) = lut[bufs[col*nsamples + 1]];
+                rgb(r, col, 2) = lut[bufs[col*nsamples + 2]];
+            }
+        }
+        else
+        {
+            for (int col = 0; col < nc; col++)
+            {
+                rgb(r, col, 0) = lut[line[col*nsamples + 0]];
+                rgb(r, col, 1) = lut[line[col*nsamples + 1]];
+                rgb(r, col, 2) = lut[line[col*nsamples + 2]];
+            }
+        }
+    }
+    return rgb;
+}
+
+
+void attach_profile(const std::string & profile, TIFF * out, const vector<uint8> & embedded)
+{
+    // If profile is requested, read the profile file and store it in tiff image.
+    if (profile != "")
+    {
+        ifstream profilestream(profile, ios::binary);
+        if (profilestream.fail())
+            throw "File could not be opened";
+        vector<char>  profileimage;
+        profilestream.seekg(0, ios_base::end);
+        auto size = profilestream.tellg();
+        profilestream.seekg(0, ios_base::beg);
+        profileimage.resize(size);
+        profilestream.read(profileimage.data(), size);
+        TIFFSetField(out, TIFFTAG_ICCPROFILE, (int)size, profileimage.data());
+    }
+    // rgb image already has a profile save it to new tiff
+    else if (embedded.size() != 0)
+    {
+        TIFFSetField(out, TIFFTAG_ICCPROFILE, (uint32)(embedded.size()), embedded.data());
+    }
+}
+
+// Parses the -O argument
+TiffCompression tiff_compression(const string &spec)
+{
+    TiffCompression compression;
+    auto colon = spec.find(':');
+    string name = spec.substr(0, colon);
+    if (colon != string::npos)
+    {
+        try {
+            compression.level = std::stoi(spec.substr(colon + 1));
+        }
+        catch (...) {
+            compression.level = -1;
+        }
+    }
+    if (name == "none" && colon == string::npos)
+        compression.scheme = COMPRESSION_NONE;
+    else if (name == "lzw" && colon == string::npos)
+        compression.scheme = COMPRESSION_LZW;
+    else if (name == "zip" && compression.level >= 0 && compression.level <= 9)
+        compression.scheme = COMPRESSION_ADOBE_DEFLATE;
+    else if (name == "zstd" && compression.level >= 0 && compression.level <= 22)
+        compression.scheme = COMPRESSION_ZSTD;
+    else
+        throw "-O mode:   mode must be none, lzw, zip[:1-9] or zstd[:1-22]\n";
+    if (!TIFFIsCODECConfigured(compression.scheme))
+        throw "-O mode:   compression not supported by this libtiff\n";
+    return compression;
+}
+
+// Sets the tags of an RGB tif with the given compression and layout
+static void set_format(TIFF *out, int nr, int nc, int rows_per_strip, bool bits16, const TiffCompression &compression)
+{
+    TIFFSetField(out, TIFFTAG_IMAGEWIDTH, nc);  // set the width of the image
+    TIFFSetField(out, TIFFTAG_IMAGELENGTH, nr);    // set the height of the image
+    TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 3);   // set number of channels per pixel
+    TIFFSetField(out, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);    // set the origin of the image.
+    TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, bits16 ? 16 : 8);    // set the size of the channels
+    if (compression.tile != 0)
+    {
+        TIFFSetField(out, TIFFTAG_TILEWIDTH, compression.tile);
+        TIFFSetField(out, TIFFTAG_TILELENGTH, compression.tile);
+    }
+    else
+        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+    TIFFSetField(out, TIFFTAG_COMPRESSION, compression.scheme);
+    if (compression.scheme != COMPRESSION_NONE)
+        TIFFSetField(out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+    if (compression.scheme == COMPRESSION_ADOBE_DEFLATE && compression.level != 0)
+        TIFFSetField(out, TIFFTAG_ZIPQUALITY, compression.level);
+    if (compression.scheme == COMPRESSION_ZSTD && compression.level != 0)
+        TIFFSetField(out, TIFFTAG_ZSTD_LEVEL, compression.level);
+}
+
+// In memory file for TIFFClientOpen. Strips and tiles are compressed by writing each as a
+// one strip or one tile tif on a worker thread, then copying out its bytes.
+struct MemFile {
+    vector<uint8> data;
+    toff_t pos = 0;
+    static tmsize_t read(thandle_t h, void *buf, tmsize_t size)
+    {
+        auto f = static_cast<MemFile *>(h);
+        size = std::max<tmsize_t>(0, std::min<tmsize_t>(size, f->data.size() - f->pos));
+        memcpy(buf, f->data.data() + f->pos, size);
+        f->pos += size;
+        return size;
+    }
+    static tmsize_t write(thandle_t h, void *buf, tmsize_t size)
+    {
+        auto f = static_cast<MemFile *>(h);
+        if (f->pos + size > f->data.size())
+            f->data.resize(f->pos + size);
+        memcpy(f->data.data() + f->pos, buf, size);
+        f->pos += size;
+        return size;
+    }
+    static toff_t seek(thandle_t h, toff_t off, int whence)
+    {
+        auto f = static_cast<MemFile *>(h);
+        f->pos = whence == SEEK_SET ? off : whence == SEEK_CUR ? f->pos + off : f->data.size() + off;
+        return f->pos;
+    }
+    static int close(thandle_t) { return 0; }
+    static toff_t size(thandle_t h) { return static_cast<MemFile *>(h)->data.size(); }
+    static int map(thandle_t, void **, toff_t *) { return 0; }
+    static void unmap(thandle_t, void *, toff_t) {}
+};
+
+// Returns the compressed bytes of one strip of nrows encoded rows, or of one
+// compression.tile square tile when nrows and nc are the tile size
+static vector<uint8> compress_strip(uint8 *rows, int nrows, int nc, bool bits16, const TiffCompression &compression)
+{
+    MemFile file;
+    TIFF *mem = TIFFClientOpen("strip", "w", &file, MemFile::read, MemFile::write, MemFile::seek,
+        MemFile::close, MemFile::size, MemFile::map, MemFile::unmap);
+    if (mem == 0)
+        throw "Could not compress tif strip";
+    std::unique_ptr<TIFF, void(*)(TIFF *)> close_mem(mem, TIFFClose);
+    set_format(mem, nrows, nc, nrows, bits16, compression);
+    size_t bytes = size_t(nrows) * nc * 3 * (bits16 ? 2 : 1);
+    bool tiled = compression.tile != 0;
+    if ((tiled ? TIFFWriteEncodedTile(mem, 0, rows, bytes) : TIFFWriteEncodedStrip(mem, 0, rows, bytes)) < 0)
+        throw "Could not compress tif strip";
+    uint64 *offsets = nullptr, *counts = nullptr;
+    TIFFGetField(mem, tiled ? TIFFTAG_TILEOFFSETS : TIFFTAG_STRIPOFFSETS, &offsets);
+    TIFFGetField(mem, tiled ? TIFFTAG_TILEBYTECOUNTS : TIFFTAG_STRIPBYTECOUNTS, &counts);
+    return vector<uint8>(file.data.begin() + offsets[0], file.data.begin() + offsets[0] + counts[0]);
+}
+
+TiffStripWriter::TiffStripWriter(const char *file, int nr, int nc, int dpi, bool bits16, float gamma,
+    const string &profile, const vector<uint8> &embedded_profile, const TiffCompression &compression)
+    : nr(nr), nc(nc), from_16bits(bits16), gamma(gamma), compression(compression)
+{
+    int sampleperpixel=3;
+    scanline = size_t(nc) * sampleperpixel * (from_16bits ? 2 : 1);
+    // Classic tif offsets are 32 bits. Compressed strips of noisy scans can come out
+    // somewhat larger than the samples, so leave room for that and the tags.
+    uint64 projected = uint64(nr) * scanline;
+    if (compression.scheme != COMPRESSION_NONE)
+        projected += projected / 4;
+    bool big = projected + (uint64(1) << 24) > (uint64(1) << 32);
+    out = TIFFOpen(file, big ? "w8" : "w");
+    if (out == 0)
+        throw "Could not open output tif";
+    if (compression.tile != 0)
+    {
+        // a batch is whole rows of tiles, enough tiles to keep the pool busy
+        int across = (nc + compression.tile - 1) / compression.tile;
+        rows_per_strip = compression.tile;
+        batch_rows = rows_per_strip * std::max(1, 4 * thread_pool().size() / across);
+    }
+    else
+    {
+        // compressed strips are ~256K so the codecs have some context to work with,
+        // uncompressed tifs are written as scanlines in batches of the same size
+        rows_per_strip = std::min(std::max(1, int((1 << 18) / scanline)), std::max(nr, 1));
+        batch_rows = rows_per_strip * 4 * thread_pool().size();
+    }
+    set_format(out, nr, nc, rows_per_strip, from_16bits, compression);
+    if (compression.scheme == COMPRESSION_NONE && compression.tile == 0)
+        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, nc*sampleperpixel));
+    TIFFSetField(out, TIFFTAG_XRESOLUTION, (float)dpi);
+    TIFFSetField(out, TIFFTAG_YRESOLUTION, (float)dpi);
+    attach_profile(profile, out, embedded_profile);
+}
+
+TiffStripWriter::~TiffStripWriter()
+{
+    if (out)
+        TIFFClose(out);
+}
+
+void TiffStripWriter::close()
+{
+    TIFFClose(out);
+    out = nullptr;
+}
+
+// 8 bit values carry the rounding error along the row so flat areas keep their mean
+template<class T>
+void encode_samples(const T *src, int n, float gamma, uint8 *dst, int step)
+{
+    auto igamma = 1 / gamma;
+    float resid = 0;    // No offset at start of each row
+    for (int c = 0; c < n; c++)
+    {
+        float tmp = 255 * pow(to_float(src[c]), igamma);
+        if (tmp > 255) tmp = 255;
+        if (tmp < 0) tmp = 0;
+        uint8 tmpr = static_cast<uint8>(tmp + .5);
+        resid += tmp - tmpr;
+        if (resid > .5 && tmpr < 255)
+        {
+            resid -= 1;
+            tmpr++;
+        }
+        else if (resid < -.5)
+        {
+            resid += 1;
+            tmpr--;
+        }
+        dst[c * step] = tmpr;
+    }
+}
+
+template<class T>
+void encode_samples(const T *src, int n, float gamma, uint16 *dst, int step)
+{
+    auto igamma = 1 / gamma;
+    for (int c = 0; c < n; c++)
+        dst[c * step] = static_cast<uint16>(pow(std::clamp(to_float(src[c]), 0.f, 1.f), igamma) * 65535);
+}
+template void encode_samples(const float *, int, float, uint8 *, int);
+template void encode_samples(const uint16 *, int, float, uint8 *, int);
+template void encode_samples(const half *, int, float, uint8 *, int);
+template void encode_samples(const float *, int, float, uint16 *, int);
+template void encode_samples(const uint16 *, int, float, uint16 *, int);
+template void encode_samples(const half *, int, float, uint16 *, int);
+
+// Converts row r of strip to tif samples at dst
+template<class T>
+void TiffStripWriter::encode_row(const ArrayRGBT<T> &strip, int r, uint8 *dst) const
+{
+    for (int color = 0; color < 3; color++)
+    {
+        if (!from_16bits)
+            encode_samples(&strip(r, 0, color), nc, gamma, dst + color, 3);
+        else
+            encode_samples(&strip(r, 0, color), nc, gamma, reinterpret_cast<uint16 *>(dst) + color, 3);
+    }
+}
+
+// Writes the encoded rows in pending. Compressed tifs keep the rows of an incomplete
+// strip for the next write except at the end of the image.
+void TiffStripWriter::flush()
+{
+    if (compression.tile != 0)
+    {
+        flush_tiles();
+        return;
+    }
+    if (compression.scheme == COMPRESSION_NONE)
+    {
+        for (size_t i = 0; written < row; i++, written++)
+        {
+            if (TIFFWriteScanline(out, &pending[i * scanline], written, 0) < 0)
+                throw "Error writing tif";
+        }
+        pending.clear();
+        return;
+    }
+    int first_strip = written / rows_per_strip;
+    int nstrips = (row - written) / rows_per_strip + (row == nr && (row - written) % rows_per_strip != 0);
+    auto strip_rows = [&](int s) { return std::min(rows_per_strip, nr - (first_strip + s) * rows_per_strip); };
+    vector<vector<uint8>> compressed(nstrips);
+    thread_pool().parallel_for(nstrips, [&](int s) {
+        compressed[s] = compress_strip(&pending[s * rows_per_strip * scanline], strip_rows(s), nc, from_16bits, compression);
+    });
+    int first_row = written;
+    for (int s = 0; s < nstrips; s++)
+    {
+        if (TIFFWriteRawStrip(out, first_strip + s, compressed[s].data(), compressed[s].size()) < 0)
+            throw "Error writing tif";
+        written += strip_rows(s);
+    }
+    pending.erase(pending.begin(), pending.begin() + (written - first_row) * scanline);
+}
+
+// Writes the rows of tiles complete in pending, and the last partial row at the end of the
+// image. Tiles past the image edge are padded with zeros; uncompressed tiles are written as is.
+void TiffStripWriter::flush_tiles()
+{
+    int tile = compression.tile;
+    int across = (nc + tile - 1) / tile;
+    int tile_rows = (row - written) / tile + (row == nr && (row - written) % tile != 0);
+    size_t tile_line = scanline / nc * tile;
+    vector<vector<uint8>> tiles(size_t(tile_rows) * across);
+    thread_pool().parallel_for(static_cast<int>(tiles.size()), [&](int i) {
+        int r0 = i / across * tile, c0 = i % across * tile;
+        int rows = std::min(tile, row - written - r0);
+        size_t cols = std::min(tile, nc - c0) * tile_line / tile;
+        vector<uint8> samples(tile_line * tile);
+        for (int r = 0; r < rows; r++)
+            memcpy(&samples[r * tile_line], &pending[(r0 + r) * scanline + c0 * tile_line / tile], cols);
+        tiles[i] = compression.scheme == COMPRESSION_NONE ? std::move(samples)
+            : compress_strip(samples.data(), tile, tile, from_16bits, compression);
+    });
+    int first_tile = written / tile * across;
+    for (size_t i = 0; i < tiles.size(); i++)
+    {
+        if (TIFFWriteRawTile(out, first_tile + static_cast<int>(i), tiles[i].data(), tiles[i].size()) < 0)
+            throw "Error writing tif";
+    }
+    int first_row = written;
+    written = std::min(row, written + tile_rows * tile);
+    pending.erase(pending.begin(), pending.begin() + (written - first_row) * scanline);
+}
+
+// Writes the next strip.nr rows
+template<class T>
+void TiffStripWriter::write(const ArrayRGBT<T> &strip)
+{
+    assert(strip.nc == nc && row + strip.nr <= nr);
+    TraceSpan span("encode", 3.0 * sizeof(T) * strip.v[0].size());
+    for (int r = 0; r < strip.nr; )
+    {
+        int n = std::min(batch_rows - (row - written), strip.nr - r);
+        size_t start = pending.size();
+        pending.resize(start + n * scanline);
+        thread_pool().parallel_for(n, [&](int i) {
+            encode_row(strip, r + i, &pending[start + i * scanline]);
+        });
+        r += n;
+        row += n;
+        if (row - written == batch_rows || row == nr)
+            flush();
+    }
+}
+
+template void TiffStripWriter::write(const ArrayRGBT<float> &strip);
+template void TiffStripWriter::write(const ArrayRGBT<uint16> &strip);
+template void TiffStripWriter::write(const ArrayRGBT<half> &strip);
+
+template<class T>
+void TiffWrite(const char *file, const ArrayRGBT<T> &rgb, const string &profile, bool adj_following_cells,
+    const TiffCompression &compression)
+{
+    TiffStripWriter out(file, rgb.nr, rgb.nc, rgb.dpi, rgb.from_16bits, rgb.gamma, profile, rgb.profile, compression);
+    out.write(rgb);
+    out.close();
+}
+template void TiffWrite(const char *, const ArrayRGBT<float> &, const string &, bool, const TiffCompression &);
+template void TiffWrite(const char *, const ArrayRGBT<uint16> &, const string &, bool, const TiffCompression &);
+template void TiffWrite(const char *, const ArrayRGBT<half> &, const string &, bool, const TiffCompression &);
+
+
+Decimator::Decimator(int nr, int nc, int dpi, const vector<int> &rates, int margin, float edge)
+    : nr(nr), nc(nc), margin(margin), edge(edge)
+{
+    row_taps = compose(nr, rates, margin);
+    col_taps = compose(nc, rates, margin);
+    out_nr = (int)row_taps.start.size();
+    out_nc = (int)col_taps.start.size();
+    out_dpi = dpi;
+    for (int rate : rates)
+        out_dpi /= rate;
+    filtered.resize(out_nc);
+    margin_row.resize(out_nc);
+    for (int y = 0; y < out_nc; y++)
+    {
+        float sum = col_taps.edge[y];
+        for (auto w : col_taps.w[y])
+            sum += w;
+        margin_row[y] = edge * sum;
+    }
+    // margin rows are already known, image rows are added by push()
+    reduced = ArrayRGB(out_nr, out_nc);
+    reduced.dpi = out_dpi;
+    for (int color = 0; color < 3; color++)
+        for (int x = 0; x < out_nr; x++)
+            for (int y = 0; y < out_nc; y++)
+                reduced(x, y, color) = row_taps.edge[x] * margin_row[y];
+}
+
+Decimator::Taps Decimator::compose(int n, const vector<int> &rates, int margin)
+{
+    // 1D factor of downsample_smooth: row sums scaled so the outer product keeps the table's sum
+    double total = 0, g[5];
+    for (int i = 0; i < 5; i++)
+    {
+        g[i] = 0;
+        for (int j = 0; j < 5; j++) g[i] += downsample_smooth[i][j];
+        total += g[i];
+    }
+    for (auto &x : g) x /= sqrt(total);
+
+    // start from identity over image plus margins, then fold in one stage at a time
+    const int n_image = n;
+    n += 2 * margin;
+    vector<int> start(n);
+    vector<vector<double>> w(n, vector<double>(1, 1.0));
+    for (int i = 0; i < n; i++) start[i] = i;
+    for (int rate : rates)
+    {
+        auto resid = (n - 1) % rate;            // same output size as downsample()
+        int xtra = resid == 0 ? 0 : rate - resid;
+        int out_n = (n + 4 + xtra - (rate == 2 ? 3 : 2)) / rate;
+        vector<int> new_start(out_n);
+        vector<vector<double>> new_w(out_n);
+        for (int x = 0; x < out_n; x++)
+        {
+            int lo = INT_MAX, hi = 0;
+            for (int i = 0; i < 5; i++)
+            {
+                int p = std::clamp(rate * x + i - 2, 0, n - 1);
+                lo = std::min(lo, start[p]);
+                hi = std::max(hi, start[p] + (int)w[p].size());
+            }
+            new_start[x] = lo;
+            new_w[x].assign(hi - lo, 0.0);
+            for (int i = 0; i < 5; i++)
+            {
+                int p = std::clamp(rate * x + i - 2, 0, n - 1);
+                for (size_t k = 0; k < w[p].size(); k++)
+                    new_w[x][start[p] - lo + k] += g[i] * w[p][k];
+            }
+        }
+        start.swap(new_start);
+        w.swap(new_w);
+        n = out_n;
+    }
+    // split each tap set into the part on the image and the summed weight on the margins
+    Taps ret;
+    for (size_t i = 0; i < w.size(); i++)
+    {
+        int lo = std::clamp(start[i] - margin, 0, n_image);
+        int hi = std::clamp(start[i] - margin + (int)w[i].size(), lo, n_image);
+        double edge = 0;
+        for (size_t k = 0; k < w[i].size(); k++)
+        {
+            int p = start[i] - margin + (int)k;
+            if (p < lo || p >= hi) edge += w[i][k];
+        }
+        ret.start.push_back(lo);
+        ret.w.emplace_back(w[i].begin() + (lo - (start[i] - margin)), w[i].begin() + (hi - (start[i] - margin)));
+        ret.edge.push_back(static_cast<float>(edge));
+    }
+    return ret;
+}
+
+// horizontal pass, one input row to out_nc values
+void Decimator::filter_row(const float *in, float *out) const
+{
+    for (int y = 0; y < out_nc; y++)
+    {
+        const float *src = in + col_taps.start[y];
+        const auto &w = col_taps.w[y];
+        float sum = col_taps.edge[y] * edge;
+        for (size_t k = 0; k < w.size(); k++)
+            sum += w[k] * src[k];
+        out[y] = sum;
+    }
+}
+
+// Whole image: row pass over bands of image rows into an nr x out_nc image,
+// then each output row starts from its margin share and gathers its image rows in order.
+template<class T>
+ArrayRGB Decimator::decimate(const ArrayRGBT<T> &from) const
+{
+    assert(from.nr == nr && from.nc == nc);
+    TraceSpan span("downsample", 3.0 * sizeof(T) * from.v[0].size());
+    ArrayRGB ret(out_nr, out_nc);
+    ret.dpi = out_dpi;
+    vector<float> rows[3];
+    for (auto &x : rows) x.resize(size_t(nr) * out_nc);
+    parallel_bands(nr, [&](int color, int start_row, int end_row) {
+        vector<float> wide(std::is_same_v<T, float> ? 0 : nc);
+        for (int r = start_row; r < end_row; r++)
+        {
+            const T *src = &from.v[color][size_t(r) * nc];
+            if constexpr (std::is_same_v<T, float>)
+                filter_row(src, &rows[color][size_t(r) * out_nc]);
+            else
+            {
+                widen(src, wide.data(), nc);
+                filter_row(wide.data(), &rows[color][size_t(r) * out_nc]);
+            }
+        }
+    });
+    parallel_bands(out_nr, [&](int color, int start_row, int end_row) {
+        for (int x = start_row; x < end_row; x++)
+        {
+            float *dst = &ret(x, 0, color);
+            for (int y = 0; y < out_nc; y++)
+                dst[y] = row_taps.edge[x] * margin_row[y];
+            const auto &w = row_taps.w[x];
+            for (size_t k = 0; k < w.size(); k++)
+            {
+                const float *src = &rows[color][size_t(row_taps.start[x] + k) * out_nc];
+                for (int y = 0; y < out_nc; y++)
+                    dst[y] += w[k] * src[y];
+            }
+        }
+    });
+    return ret;
+}
+
+template ArrayRGB Decimator::decimate(const ArrayRGBT<float> &from) const;
+template ArrayRGB Decimator::decimate(const ArrayRGBT<uint16> &from) const;
+template ArrayRGB Decimator::decimate(const ArrayRGBT<half> &from) const;
+
+// Streaming: each image row is filtered then added into the output rows whose taps
+// cover it. Same additions in the same order as decimate().
+void Decimator::push(const float *red, const float *green, const float *blue)
+{
+    assert(rows_in < nr);
+    const float *in[3] = { red, green, blue };
+    int r = rows_in++;
+    while (first_out < out_nr && row_taps.start[first_out] + (int)row_taps.w[first_out].size() <= r)
+        first_out++;
+    for (int color = 0; color < 3; color++)
+    {
+        filter_row(in[color], filtered.data());
+        // output row taps are in order, rows before first_out are complete
+        for (int x = first_out; x < out_nr && row_taps.start[x] <= r; x++)
+        {
+            int k = r - row_taps.start[x];
+            float *dst = &reduced(x, 0, color);
+            for (int y = 0; y < out_nc; y++)
+                dst[y] += row_taps.w[x][k] * filtered[y];
+        }
+    }
+}
+
+ArrayRGB Decimator::margin_response() const
+{
+    ArrayRGB ret(out_nr, out_nc);
+    ret.dpi = out_dpi;
+    // a margin row filters to row_sum, an image row to its column margin weights
+    vector<float> row_sum(out_nc);
+    for (int y = 0; y < out_nc; y++)
+        row_sum[y] = std::accumulate(col_taps.w[y].begin(), col_taps.w[y].end(), col_taps.edge[y]);
+    for (int x = 0; x < out_nr; x++)
+    {
+        float image_rows = std::accumulate(row_taps.w[x].begin(), row_taps.w[x].end(), 0.0f);
+        for (int y = 0; y < out_nc; y++)
+            ret(x, y, 0) = ret(x, y, 1) = ret(x, y, 2) = row_taps.edge[x] * row_sum[y] + image_rows * col_taps.edge[y];
+    }
+    return ret;
+}
+
+
+template<class T>
+void ArrayRGBT<T>::fill(float red, float green, float blue) {
+    for (auto& x:v[0]) { x = from_float<T>(red); }
+    for (auto& x:v[1]) { x = from_float<T>(green); }
+    for (auto& x:v[2]) { x = from_float<T>(blue); }
+}
+
+template<class T>
+void ArrayRGBT<T>::copy(const ArrayRGBT &from, int offsetx, int offsety)
+{
+    //assert(from.nr + offsetx < nr);
+    //assert(from.nc + offsety < nc);
+    for (int color = 0; color < 3; color++)
+        for (int x = 0; x < from.nr; x++)
+            for (int y = 0; y < from.nc; y++)
+                (*this)(x+offsetx, y+offsety, color) = from(x, y, color);
+}
+
+template<class T>
+ArrayRGBT<T> ArrayRGBT<T>::subArray(int rs, int re, int cs, int ce)
+{
+    assert(rs <= re && re < nr);
+    assert(cs <= ce && ce < nc);
+    ArrayRGBT s(re-rs+1, ce-cs+1);
+    for (int color = 0; color < 3; color++)
+        for (int r = rs; r <= re; r++)
+            for (int c = cs; c <= ce; c++)
+                s(r-rs, c-cs, color) = (*this)(r, c, color);
+    return s;
+}
+
+template<class T>
+void ArrayRGBT<T>::copyColumn(int to, int from)
+{
+    for (int color = 0; color < 3; color++)
+        for (int r = 0; r < nr; r++)
+            (*this)(r, to, color) = (*this)(r, from, color);
+}
+
+template<class T>
+void ArrayRGBT<T>::copyRow(int to, int from)
+{
+    for (int color = 0; color < 3; color++)
+        for (int c = 0; c < nc; c++)
+            (*this)(to, c, color) = (*this)(from, c, color);
+}
+
+template<class T>
+array<float, 3> ArrayRGBT<T>::sum() {
+    array<float, 3> ret;
+    for (int color = 0; color < 3; color++)
+        ret[color] = accumulate(v[color].cbegin(), v[color].cend(), 0.f,
+            [](float sum, T x) { return sum + to_float(x); });
+    return ret;
+}
+
+template<class T>
+void ArrayRGBT<T>::scale(float factor)    // scale all array values by factor
+{
+    for (int i = 0; i < 3; i++)
+        for (auto &x:v[i])
+            x = from_float<T>(to_float(x) * factor);
+}
+
+template class ArrayRGBT<float>;
+template class ArrayRGBT<uint16>;
+template class ArrayRGBT<half>;
+
+
+
+// reflection function based on 200 DPI
+static const float refl_fraction = .20f;
+static const array<float, 6> fvc{ 1.361e-15f, -3.737e-12f, 4.042e-09f, -2.156e-06f, 0.0005713f, 0 };
+static const array<float, 8> fhc{ 7.729e-20f,-1.842e-16f,1.793e-13f,-9.23e-11f,2.756e-08f,-5.168e-06f,0.0006892f,0 };
+static const float fv_scale = .9574f;
+static const float fv_tweak = 1.1f;         // applied to the distance fed to fv
+static const float refl_peak = .0838f;      // kernel value at distance 0
+static const float refl_ref = .0579f;       // fv/fh value the peak is scaled against
+static const float refl_units = 400;        // model distances are in 1/400 inch
+static const float refl_dist_cap = 400;     // fv and fh are fitted out to this distance
+// first (disabled) model: symetric pattern fit
+static const array<float, 5> fv0c{ -8.72e-13f, 2.002e-9f, -1.674e-6f, 0.0006124f, -0.0838040f };
+static const float fv0_cap = 560;
+
+// FNV-1a hash of the reflection model constants, changes whenever the model does
+uint64 refl_model_hash()
+{
+    uint64 hash = 14695981039346656037ull;
+    auto add = [&hash](const void *p, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            hash = (hash ^ static_cast<const uint8 *>(p)[i]) * 1099511628211ull;
+    };
+    add(&refl_fraction, sizeof(refl_fraction));
+    add(fvc.data(), sizeof(fvc));
+    add(fhc.data(), sizeof(fhc));
+    for (float v: { fv_scale, fv_tweak, refl_peak, refl_ref, refl_units, refl_dist_cap, fv0_cap })
+        add(&v, sizeof(v));
+    add(fv0c.data(), sizeof(fv0c));
+    return hash;
+}
+
+// Reflection kernel dpi for a scan dpi, found by dividing by 3 then by 2 while the result
+// stays at least 90 and 60. x3 and x2 are the number of each division.
+int reduced_refl_dpi(int dpi, int &x2, int &x3)
+{
+	x2 = 0;
+	x3 = 0;
+	while (dpi >= 90 && dpi % 3 == 0)
+	{
+		dpi /= 3;
+		x3++;
+	}
+	while (dpi >= 60 && dpi % 2 == 0)
+	{
+		dpi /= 2;
+		x2++;
+	}
+	return dpi;
+}
+
+tuple<ArrayRGB,int,int> getReflArea(const int dpi, const int use_this_size_if_not_0)
+{
+    auto actual_dpi = !use_this_size_if_not_0 ? dpi : use_this_size_if_not_0;
+    float gain = 1;
+	int x2 = 0;
+	int x3 = 0;
+	if (!use_this_size_if_not_0)		// find smaller size for faster interpolation (normal usage)
+		actual_dpi = reduced_refl_dpi(dpi, x2, x3);
+    gain = refl_units/actual_dpi;
+    int refl_size = (int)round(actual_dpi*2+1);
+    //fv = @(x) .9574*(1.361e-15*x.^5-3.737e-12*x.^4+4.042e-09*x.^3-2.156e-06*x.^2+0.0005713*x);
+    //fh = @(x) 7.729e-20*x.^7-1.842e-16*x.^6+1.793e-13*x.^5-9.23e-11*x.^4+2.756e-08*x.^3-5.168e-06*x.^2+0.0006892*x;
+    auto fv = [](float x) {
+        if (x > refl_dist_cap) x = refl_dist_cap;
+        float s = 0;
+        for (auto v: fvc) s = s*x+v;
+        return fv_scale*s;
+    };
+    auto fh = [](float x) {
+        if (x > refl_dist_cap) x = refl_dist_cap;
+        float s = 0;
+        for (auto v: fhc) s = s*x+v;
+        return s;
+    };
+    auto fv0 = [](float x) {
+        if (x > fv0_cap) x = fv0_cap;
+        float s = 0;
+        for (auto v: fv0c) s = s*x+v;
+        return -s;
+    };
+    ArrayRGB ret(2*actual_dpi+1, 2*actual_dpi+1, actual_dpi);
+    for (int i = 0; i < ret.nr; i++)
+    {
+        for (int ii = 0; ii < ret.nc; ii++)
+        {
+            // There are two algorithms for estimating the amout of light reflected.
+            // The first was from 6mm square, symetric patterns, the second from 4 pages of randomly distributed
+            // 3mm white/black squares. They are both quite good but the second is slightly better.
+            // The first one is remains, but is disabled.
+            if (false) {
+                float offset = (ret.nc-1)/2.0f;
+				float offx = i-offset;
+				float offy = ii-offset;
+                float dist = sqrt(1.7f*offx*offx + 1.5f*offy*offy);
+                float gain_total = gain*dist < fv0_cap ? gain*dist : fv0_cap;
+                ret(i, ii, 0) = ret(i, ii, 1) = ret(i, ii, 2) = fv0(gain_total);
+            }
+            else
+            {
+				float p1, p2;
+				float offset = (ret.nc-1)/2.0f;
+				float offx = abs(gain*(i-offset)); if (offx > refl_dist_cap) offx = refl_dist_cap;
+				float offy = abs(gain*(ii-offset)); if (offy > refl_dist_cap) offy = refl_dist_cap;
+                float dist = sqrt(offx*offx + offy*offy+.0000001f); dist <= refl_dist_cap ? dist: refl_dist_cap;
+                p1 = offx/(offx+offy+.00001f) * (refl_peak - (refl_peak/refl_ref)*fv(fv_tweak*dist));
+                p2 = offy/(offx+offy+.00001f) * (refl_peak - (refl_peak/refl_ref)*fh(dist));
+				if (offx == 0 && offy == 0)
+					ret(i, ii, 0) = ret(i, ii, 1) = ret(i, ii, 2) = refl_peak - (refl_peak / refl_ref)*fv(fv_tweak*dist);
+				else
+					ret(i, ii, 0) = ret(i, ii, 1) = ret(i, ii, 2) = p1+p2;
+            }
+        }
+    }
+    auto sum = ret.sum();
+    auto factor = refl_fraction/sum[0];
+    for (int c = 0; c < 3; c++)
+        for (int i = 0; i < ret.nr; i++)
+            for (int ii = 0; ii < ret.nc; ii++)
+                ret(i, ii, c) *= factor;
+    //auto check_sum = ret.sum();
+    //auto check_factor = refl_fraction/check_sum[0];
+    return std::make_tuple(ret, x2, x3);
+}
+
+
+//float & ArrayRGB::operator()(int r, int c, int color)
+//{
+//	return v[color][r*nc + c];
+//}
+//
+
+// Create interpolated re-reflected values from original
+// remove 1" surround and set DPI at reduced resolution
+ArrayRGB generate_reflected_light_estimate(const ArrayRGB& image_reduced, const ArrayRGB& refl_area)
+{
+	ArrayRGB image_correction = ArrayRGB(image_reduced.nr - 2 * image_reduced.dpi,
+		image_reduced.nc - 2 * image_reduced.dpi,
+		image_reduced.dpi,
+		image_reduced.from_16bits,
+		image_reduced.gamma
+	);
+
+	auto fix = [&image_reduced, &refl_area, &image_correction](int s_row, int e_row, int color) {
+		for (int i = s_row; i < e_row; i++)
+		{
+			for (int ii = 0; ii < image_reduced.nc - refl_area.nc + 1; ii++)
+			{
+				float sum = 0;
+				for (int j = 0; j < refl_area.nr; j++)
+				{
+					for (int jj = 0; jj < refl_area.nc; jj++)
+					{
+						sum += image_reduced(i + j, ii + jj, color)*refl_area(j, jj, color);
+					}
+				}
+				image_correction(i, ii, color) = sum;
+			}
+		}
+	};
+	parallel_bands(image_reduced.nr - refl_area.nr + 1, [&fix](int color, int s_row, int e_row) {
+		fix(s_row, e_row, color);
+	});
+	return image_correction;
 }
\ No newline at end of file
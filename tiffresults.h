@@ -1,194 +1,315 @@
-/*
-Copyright (c) <2018> <doug gray>
-
-Permission is hereby granted, free of charge, to any person obtaining a copy
-of this software and associated documentation files (the "Software"), to deal
-in the Software without restriction, including without limitation the rights
-to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
-copies of the Software, and to permit persons to whom the Software is
-furnished to do so, subject to the following conditions:
-
-The above copyright notice and this permission notice shall be included in all
-copies or substantial portions of the Software.
-
-THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
-AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
-LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-SOFTWARE.
-*/
-
-#ifndef TIFFRESULTS_H
-#define TIFFRESULTS_H
-
-// Requires libtiff.  www.libtiff.org
-// For some reason Adobe Photoshop Tiff files use a field type of
-// 7 (UNDEFINED) for some extra metadata that needs to be ignored
-// but may be printed. Patch the source or ignore the message.
-// See line 1554 in tif_dirread.c
-
-#include <tiffio.h>
-#include <string>
-#include <vector>
-#include <array>
-#include <cassert>
-#include <cmath>
-#include <numeric>
-#include <chrono>
-#include <future>
-
-// Common std types
-using std::vector;
-using std::string;
-using std::array;
-using std::ifstream;
-using std::ios_base;
-using std::ios;
-using std::tuple;
-
-
-class ArrayRGB;
-void attach_profile(const std::string & profile, TIFF * out, const ArrayRGB & rgb);
-// Functions
-void TiffWrite(const char *file, const ArrayRGB &rgb, const string &profile, bool adj_following_cells = true);
-ArrayRGB TiffRead(const char *filename, float gamma);
-tuple<ArrayRGB, int, int> getReflArea(const int dpi, const int use_this_size_if_not_0 = 0);
-ArrayRGB generate_reflected_light_estimate(const ArrayRGB& image_reduced, const ArrayRGB& refl_area);
-
-
-//#define DISABLE_ASYNC_THREADS
-#ifdef DISABLE_ASYNC_THREADS
-static auto launchType = std::launch::deferred;
-#else
-static auto launchType = std::launch::async;
-#endif
-
-
-struct Timer {
-    int count = 0;
-    std::chrono::system_clock::time_point snapTime, tmp;
-    double cumTime = 0;
-    Timer() { reset(); }
-    void reset() { count = 0; cumTime = 0; start(); }
-    void start() { snapTime = std::chrono::system_clock::now(); }
-    double stop() { cumTime += std::chrono::duration<double>((tmp = std::chrono::system_clock::now()) - snapTime).count(); count++; snapTime = tmp; return cumTime; }
-};
-
-
-
-// Floating point RGB array representing an image including some context info
-// RGB values are stored in separate vectors since operations on each are independant
-// and so can be easily multi-threaded. Values are normally in gamma=1 and are [0:1]
-class ArrayRGB {
-public:
-    vector<float> v[3];
-    vector<uint8> profile;     // size is zero if no profile attached to image
-    int dpi;
-    int nc, nr;
-    float gamma;
-    bool from_16bits;
-    ArrayRGB(int NR = 0, int NC = 0, int DPI=0, bool bits16=true, float gamma=1.7)
-        : nc(NC), nr(NR), dpi(DPI), from_16bits(bits16),
-          gamma(gamma) { for (auto& x:v) x.resize(NR*NC); }
-    void resize(int nrows, int ncols) { nr = nrows; nc = ncols; for (auto& x:v) x.resize(nc*nr); }
-    void fill(float red, float green, float blue);
-    void copy(const ArrayRGB &from, int offsetx, int offsety);
-    ArrayRGB subArray(int rs, int re, int cs, int ce);
-    void copyColumn(int to, int from);
-    void copyRow(int to, int from);
-    float & operator()(int r, int c, int color) { return v[color][r*nc+c]; }
-	//float & operator()(int r, int c, int color);
-    float const & operator()(int r, int c, int color) const {return v[color][r*nc+c];}
-    array<float, 3> sum();
-    void scale(float factor);    // scale all array values by factor
-};
-
-
-// mod((6-1), 3) if not 0, subtract 3 for extra padding
-// This function is used to downsize the original image in multiples of 2 and/or 3
-// since high resolution is not needed for calculating extra light reflectance.
-inline ArrayRGB downsample(const ArrayRGB &from, int rate)
-{
-	auto xtra = [](int rc, int rate) {  // calc needed extra row/col elements
-		auto resid = (rc - 1) % rate;
-		return resid == 0 ? 0 : rate - resid;
-	};
-	auto xtra_r = xtra(from.nr, rate); auto xtra_c = xtra(from.nc, rate);
-	ArrayRGB fromEx(from.nr + 4 + xtra_r, from.nc + 4 + xtra_c);  // Expand sides by 2;
-	fromEx.copy(from, 2, 2);
-
-	for (int i = 0; i < xtra_c; i++)    // duplicate last column(s)
-		fromEx.copyColumn(from.nc + 2 + i, from.nc + 1 + i);
-	for (int i = 0; i < xtra_r; i++)    // duplicate last rows(s)
-		fromEx.copyRow(from.nr + 2 + i, from.nr + 1 + i);
-	for (int i = 1; i >= 0; i--)    // duplicate first column(s)
-		fromEx.copyColumn(i, i + 1);
-	for (int i = 1; i >= 0; i--)    // duplicate first rows(s)
-		fromEx.copyRow(i, i + 1);
-	fromEx.copyColumn(fromEx.nc - 2, fromEx.nc - 3);
-	fromEx.copyColumn(fromEx.nc - 1, fromEx.nc - 3);
-	fromEx.copyRow(fromEx.nr - 2, fromEx.nr - 3);
-	fromEx.copyRow(fromEx.nr - 1, fromEx.nr - 3);
-
-
-	int nr = (fromEx.nr - (rate == 2 ? 3 : 2)) / rate;
-	int nc = (fromEx.nc - (rate == 2 ? 3 : 2)) / rate;
-
-	ArrayRGB ret(nr, nc);
-	// fspecial('gaussian',5,1.2)
-	array<array<float, 5>, 5> smooth{
-		0.0073f,    0.0208f,    0.0294f,    0.0208f,    0.0073f,
-		0.0208f,    0.0589f,    0.0833f,    0.0589f,    0.0208f,
-		0.0294f,    0.0833f,    0.1179f,    0.0833f,    0.0294f,
-		0.0208f,    0.0589f,    0.0833f,    0.0589f,    0.0208f,
-		0.0073f,    0.0208f,    0.0294f,    0.0208f,    0.0073f };
-
-	for (int color = 0; color <= 2; color++)
-	{
-		for (int x = 0; x < nr; x++) {            // interate over destination array
-			for (int y = 0; y < nc; y++)
-			{
-				int xs = rate * x;
-				int ys = rate * y;
-				float prodsum = 0;
-				for (int i = 0; i < 5; i++) {
-					for (int j = 0; j < 5; j++) {
-						assert(xs + i < fromEx.nr);
-						assert(ys + j < fromEx.nc);
-						prodsum += smooth[i][j] * fromEx(xs + i, ys + j, color);
-					}
-				}
-				ret(x, y, color) = prodsum;
-			}
-		}
-	}
-	ret.dpi = from.dpi / rate;
-	return ret;
-}
-
-
-
-// f(0,0)(1-x)(1-y) +f(1,0)x(y-1)+f(0,1)(1-x)y + f(1,1)xy
-// https://en.wikipedia.org/wiki/Bilinear_interpolation
-inline float bilinear(ArrayRGB &correction, int r, int c, int reduction, int color)
-{
-    auto r0 = r/reduction;
-    auto r1 = r/reduction+1;
-    auto c0 = c/reduction;
-    auto c1 = c/reduction+1;
-    if (c1 > correction.nc-1) c1 = correction.nc-1;
-    if (r1 > correction.nr-1) r1 = correction.nr-1;
-    float dr = static_cast<float>(r%reduction)/reduction;
-    float dc = static_cast<float>(c%reduction)/reduction;
-
-    auto q00= correction(r0, c0, color);
-    auto q01 = correction(r0, c1, color);
-    auto q10 = correction(r1, c0, color);
-    auto q11 = correction(r1, c1, color);
-    auto v = q00*(1-dr)*(1-dc)+q10*dr*(1-dc)+q01*(1-dr)*dc+q11*dr*dc;
-    return v;
-}
-
-#endif
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef TIFFRESULTS_H
+#define TIFFRESULTS_H
+
+// Requires libtiff.  www.libtiff.org
+// For some reason Adobe Photoshop Tiff files use a field type of
+// 7 (UNDEFINED) for some extra metadata that needs to be ignored
+// but may be printed. Patch the source or ignore the message.
+// See line 1554 in tif_dirread.c
+
+#include <tiffio.h>
+#include <string>
+#include <vector>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+#include <chrono>
+#include <future>
+#include "threadpool.h"
+#include "pixelstorage.h"
+#include "scratchstorage.h"
+
+// Common std types
+using std::vector;
+using std::string;
+using std::array;
+using std::ifstream;
+using std::ios_base;
+using std::ios;
+using std::tuple;
+
+
+template<class T> class ArrayRGBT;
+using ArrayRGB = ArrayRGBT<float>;
+
+// Output tif compression and layout. Compressed output uses the horizontal predictor.
+struct TiffCompression {
+    uint16 scheme = COMPRESSION_NONE;   // COMPRESSION_NONE, _LZW, _ADOBE_DEFLATE or _ZSTD
+    int level = 0;                      // Deflate 1-9 or ZSTD 1-22, 0 for the codec default
+    int tile = 0;                       // tile width and length, a multiple of 16, 0 for strips
+};
+TiffCompression tiff_compression(const string &spec);      // "none", "lzw", "zip[:level]" or "zstd[:level]"
+
+void attach_profile(const std::string & profile, TIFF * out, const vector<uint8> & embedded);
+// Functions
+template<class T>
+void TiffWrite(const char *file, const ArrayRGBT<T> &rgb, const string &profile, bool adj_following_cells = true,
+    const TiffCompression &compression = TiffCompression());
+template<class T = float>
+ArrayRGBT<T> TiffRead(const char *filename, float gamma);
+const vector<float> &decode_table(int bits, float gamma);
+tuple<ArrayRGB, int, int> getReflArea(const int dpi, const int use_this_size_if_not_0 = 0);
+int reduced_refl_dpi(int dpi, int &x2, int &x3);      // dpi of getReflArea()'s kernel for a scan dpi
+uint64 refl_model_hash();                               // identifies the getReflArea() model constants
+ArrayRGB generate_reflected_light_estimate(const ArrayRGB& image_reduced, const ArrayRGB& refl_area);
+
+
+struct Timer {
+    int count = 0;
+    std::chrono::system_clock::time_point snapTime, tmp;
+    double cumTime = 0;
+    Timer() { reset(); }
+    void reset() { count = 0; cumTime = 0; start(); }
+    void start() { snapTime = std::chrono::system_clock::now(); }
+    double stop() { cumTime += std::chrono::duration<double>((tmp = std::chrono::system_clock::now()) - snapTime).count(); count++; snapTime = tmp; return cumTime; }
+};
+
+
+
+// Floating point RGB array representing an image including some context info
+// RGB values are stored in separate vectors since operations on each are independant
+// and so can be easily multi-threaded. Values are normally in gamma=1 and are [0:1]
+// Full resolution images may store T = uint16 or half samples instead (pixelstorage.h)
+// to halve their memory; everything else is ArrayRGB, T = float.
+template<class T>
+class ArrayRGBT {
+public:
+    vector<T, PlaneAllocator<T>> v[3];     // heap, or scratch files with --scratch-dir
+    vector<uint8> profile;     // size is zero if no profile attached to image
+    int dpi;
+    int nc, nr;
+    float gamma;
+    bool from_16bits;
+    ArrayRGBT(int NR = 0, int NC = 0, int DPI=0, bool bits16=true, float gamma=1.7)
+        : nc(NC), nr(NR), dpi(DPI), from_16bits(bits16),
+          gamma(gamma) { for (auto& x:v) x.resize(NR*NC); }
+    void resize(int nrows, int ncols) { nr = nrows; nc = ncols; for (auto& x:v) x.resize(nc*nr); }
+    void fill(float red, float green, float blue);
+    void copy(const ArrayRGBT &from, int offsetx, int offsety);
+    ArrayRGBT subArray(int rs, int re, int cs, int ce);
+    void copyColumn(int to, int from);
+    void copyRow(int to, int from);
+    T & operator()(int r, int c, int color) { return v[color][r*nc+c]; }
+	//float & operator()(int r, int c, int color);
+    T const & operator()(int r, int c, int color) const {return v[color][r*nc+c];}
+    array<float, 3> sum();
+    void scale(float factor);    // scale all array values by factor
+};
+extern template class ArrayRGBT<float>;
+extern template class ArrayRGBT<uint16>;
+extern template class ArrayRGBT<half>;
+
+
+// Reads a contiguous 8 or 16 bit RGB tif, stripped or tiled, a strip of rows at a time,
+// top to bottom. Values are converted to gamma=1 [0:1] exactly as TiffRead() does.
+class TiffStripReader {
+public:
+    TiffStripReader(const char *filename, float gamma);
+    ~TiffStripReader();
+    TiffStripReader(const TiffStripReader &) = delete;
+    TiffStripReader &operator=(const TiffStripReader &) = delete;
+    static bool can_read(const char *filename);   // false for other tifs, TiffRead() still reads those
+    ArrayRGB read(int nrows);
+    void seek(int first_row) { assert(first_row >= row); row = first_row; }    // skips rows, forward only
+    int nr, nc, dpi;
+    bool from_16bits;
+    float gamma;
+    vector<uint8> profile;
+    int row = 0;                // next row read() returns
+private:
+    const uint8 *scanline(int r);
+    TIFF *tif;
+    uint16 nsamples = 3;
+    vector<uint8> buf;          // a scanline, or a row of tiles as scanlines
+    vector<uint8> tile;
+    uint32 tile_width = 0, tile_length = 0;     // 0 for stripped tifs
+    int tile_row = -1;          // first row of the row of tiles in buf
+};
+
+// Gamma encodes n linear [0:1] samples to dst[0], dst[step], ... exactly as tifs are written.
+// 8 bit rounding error is carried along the n samples, so pass whole rows.
+template<class T> void encode_samples(const T *src, int n, float gamma, uint8 *dst, int step);
+template<class T> void encode_samples(const T *src, int n, float gamma, uint16 *dst, int step);
+
+// Writes a tif a strip of rows at a time, top to bottom. TiffWrite() is one strip.
+// Rows are encoded and tif strips compressed in batches on the thread pool, then
+// written in order as raw strips. Tiled tifs are written a row of tiles at a time, the
+// tiles of a row compressed in parallel. Files that could pass 4GB are written as BigTIFF.
+class TiffStripWriter {
+public:
+    TiffStripWriter(const char *file, int nr, int nc, int dpi, bool bits16, float gamma,
+        const string &profile, const vector<uint8> &embedded_profile,
+        const TiffCompression &compression = TiffCompression());
+    ~TiffStripWriter();
+    TiffStripWriter(const TiffStripWriter &) = delete;
+    TiffStripWriter &operator=(const TiffStripWriter &) = delete;
+    template<class T> void write(const ArrayRGBT<T> &strip);
+    void close();
+    int nr, nc;
+    bool from_16bits;
+    float gamma;
+    int row = 0;                // next row write() stores
+private:
+    template<class T> void encode_row(const ArrayRGBT<T> &strip, int r, uint8 *dst) const;
+    void flush();
+    void flush_tiles();
+    TIFF *out;
+    TiffCompression compression;
+    int rows_per_strip;         // or tile length
+    int batch_rows;             // rows encoded before their strips are compressed and written
+    size_t scanline;            // bytes per encoded row
+    int written = 0;            // rows [written, row) are encoded in pending
+    vector<uint8, PlaneAllocator<uint8>> pending;
+};
+
+
+// fspecial('gaussian',5,1.2)
+static const array<array<float, 5>, 5> downsample_smooth{
+	0.0073f,    0.0208f,    0.0294f,    0.0208f,    0.0073f,
+	0.0208f,    0.0589f,    0.0833f,    0.0589f,    0.0208f,
+	0.0294f,    0.0833f,    0.1179f,    0.0833f,    0.0294f,
+	0.0208f,    0.0589f,    0.0833f,    0.0589f,    0.0208f,
+	0.0073f,    0.0208f,    0.0294f,    0.0208f,    0.0073f };
+
+// mod((6-1), 3) if not 0, subtract 3 for extra padding
+// This function is used to downsize the original image in multiples of 2 and/or 3
+// since high resolution is not needed for calculating extra light reflectance.
+inline ArrayRGB downsample(const ArrayRGB &from, int rate)
+{
+	auto xtra = [](int rc, int rate) {  // calc needed extra row/col elements
+		auto resid = (rc - 1) % rate;
+		return resid == 0 ? 0 : rate - resid;
+	};
+	auto xtra_r = xtra(from.nr, rate); auto xtra_c = xtra(from.nc, rate);
+	ArrayRGB fromEx(from.nr + 4 + xtra_r, from.nc + 4 + xtra_c);  // Expand sides by 2;
+	fromEx.copy(from, 2, 2);
+
+	for (int i = 0; i < xtra_c; i++)    // duplicate last column(s)
+		fromEx.copyColumn(from.nc + 2 + i, from.nc + 1 + i);
+	for (int i = 0; i < xtra_r; i++)    // duplicate last rows(s)
+		fromEx.copyRow(from.nr + 2 + i, from.nr + 1 + i);
+	for (int i = 1; i >= 0; i--)    // duplicate first column(s)
+		fromEx.copyColumn(i, i + 1);
+	for (int i = 1; i >= 0; i--)    // duplicate first rows(s)
+		fromEx.copyRow(i, i + 1);
+	fromEx.copyColumn(fromEx.nc - 2, fromEx.nc - 3);
+	fromEx.copyColumn(fromEx.nc - 1, fromEx.nc - 3);
+	fromEx.copyRow(fromEx.nr - 2, fromEx.nr - 3);
+	fromEx.copyRow(fromEx.nr - 1, fromEx.nr - 3);
+
+
+	int nr = (fromEx.nr - (rate == 2 ? 3 : 2)) / rate;
+	int nc = (fromEx.nc - (rate == 2 ? 3 : 2)) / rate;
+
+	ArrayRGB ret(nr, nc);
+	auto &smooth = downsample_smooth;
+
+	parallel_bands(nr, [&](int color, int start_row, int end_row) {
+		for (int x = start_row; x < end_row; x++) {            // interate over destination array
+			for (int y = 0; y < nc; y++)
+			{
+				int xs = rate * x;
+				int ys = rate * y;
+				float prodsum = 0;
+				for (int i = 0; i < 5; i++) {
+					for (int j = 0; j < 5; j++) {
+						assert(xs + i < fromEx.nr);
+						assert(ys + j < fromEx.nc);
+						prodsum += smooth[i][j] * fromEx(xs + i, ys + j, color);
+					}
+				}
+				ret(x, y, color) = prodsum;
+			}
+		}
+	});
+	ret.dpi = from.dpi / rate;
+	return ret;
+}
+
+
+
+// Single stage replacement for a chain of downsample() calls. Each downsample() is a
+// 5x5 gaussian with edge rows/cols duplicated, then decimation by 2 or 3. Both steps are
+// linear and act on rows and columns independently (the 5x5 table is the outer product
+// of its row sums to 4 digits), so the whole chain collapses to one set of row taps and
+// one set of column taps from the input straight to the reduced size. Edges are handled
+// by clamping indices while the taps are built. Results match the chain to float rounding.
+// The frame being decimated can extend margin pixels past each side of the image. Those
+// samples are the constant edge value and are never stored: each tap set carries the
+// summed weight that falls on the margin.
+class Decimator {
+public:
+    Decimator(int nr, int nc, int dpi, const vector<int> &rates, int margin = 0, float edge = 0);
+    int nr, nc;                         // image size, not including margins
+    int margin;
+    float edge;
+    int out_nr, out_nc, out_dpi;        // decimated frame, including margins
+    template<class T> ArrayRGB decimate(const ArrayRGBT<T> &from) const;
+    // Streaming use: push all nr input rows top to bottom, then take result()
+    void push(const float *red, const float *green, const float *blue);
+    ArrayRGB &result() { return reduced; }
+    // The decimated frame of a black image with margins of 1. Decimation is linear, so
+    // decimating with edge e is decimating with edge 0 plus e times this.
+    ArrayRGB margin_response() const;
+private:
+    struct Taps {                       // output i = edge[i]*edge value + sum over k of w[i][k] * image[start[i] + k]
+        vector<int> start;
+        vector<vector<float>> w;
+        vector<float> edge;
+    };
+    static Taps compose(int n, const vector<int> &rates, int margin);
+    void filter_row(const float *in, float *out) const;
+    Taps row_taps, col_taps;
+    ArrayRGB reduced;
+    int rows_in = 0;
+    int first_out = 0;                  // first output row still receiving input rows
+    vector<float> filtered;
+    vector<float> margin_row;           // a row pass over a row that is all margin
+};
+
+
+// f(0,0)(1-x)(1-y) +f(1,0)x(y-1)+f(0,1)(1-x)y + f(1,1)xy
+// https://en.wikipedia.org/wiki/Bilinear_interpolation
+inline float bilinear(ArrayRGB &correction, int r, int c, int reduction, int color)
+{
+    auto r0 = r/reduction;
+    auto r1 = r/reduction+1;
+    auto c0 = c/reduction;
+    auto c1 = c/reduction+1;
+    if (c1 > correction.nc-1) c1 = correction.nc-1;
+    if (r1 > correction.nr-1) r1 = correction.nr-1;
+    float dr = static_cast<float>(r%reduction)/reduction;
+    float dc = static_cast<float>(c%reduction)/reduction;
+
+    auto q00= correction(r0, c0, color);
+    auto q01 = correction(r0, c1, color);
+    auto q10 = correction(r1, c0, color);
+    auto q11 = correction(r1, c1, color);
+    auto v = q00*(1-dr)*(1-dc)+q10*dr*(1-dc)+q01*(1-dr)*dc+q11*dr*dc;
+    return v;
+}
+
+#endif
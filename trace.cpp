@@ -0,0 +1,177 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include "trace.h"
+#include "scratchstorage.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+    struct Event {
+        const char *name;
+        int tid;
+        double start, end;      // microseconds
+        double bytes;
+        size_t rss;
+    };
+    bool on = false;
+    std::string trace_file;
+    std::chrono::steady_clock::time_point origin;
+    std::mutex m;
+    std::vector<Event> events;
+    std::atomic<int> next_tid{ 0 };
+    thread_local int tid = -1;
+    thread_local const char *current = nullptr;
+
+    int thread_id()
+    {
+        if (tid < 0)
+            tid = next_tid++;
+        return tid;
+    }
+}
+
+void trace_start(const std::string &file)
+{
+    trace_file = file;
+    origin = std::chrono::steady_clock::now();
+    thread_id();            // the main thread is 0
+    on = true;
+}
+
+bool tracing()
+{
+    return on;
+}
+
+double trace_now()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+}
+
+const char *trace_current()
+{
+    return current;
+}
+
+const char *trace_set_current(const char *name)
+{
+    const char *previous = current;
+    current = name;
+    return previous;
+}
+
+void trace_event(const char *name, double start, double end, double bytes)
+{
+    if (!on)
+        return;
+    Event e{ name, thread_id(), start, end, bytes, peak_rss() };
+    std::lock_guard<std::mutex> lock(m);
+    events.push_back(e);
+}
+
+size_t peak_rss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);            // bytes
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;     // kilobytes
+#endif
+#endif
+}
+
+TraceSpan::TraceSpan(const char *name, double bytes) : name(name), outer(current), start(0), bytes(bytes)
+{
+    current = name;
+    if (!on)
+        return;
+    start = trace_now();
+}
+
+TraceSpan::~TraceSpan()
+{
+    current = outer;
+    if (!on)
+        return;
+    trace_event(name, start, trace_now(), bytes);
+}
+
+// Complete ("X") events, one per span, plus thread names. args carry bytes, MB/s and
+// the peak RSS in MB at the end of the span.
+// otherData has the image buffer allocations by stage.
+void trace_finish()
+{
+    if (!on)
+        return;
+    on = false;
+    std::ofstream out(trace_file);
+    if (!out)
+        throw "Could not write trace file";
+    out << "{\"traceEvents\":[\n";
+    out.precision(15);
+    for (int t = 0; t < next_tid; t++)
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t
+            << ",\"args\":{\"name\":\"" << (t == 0 ? "main" : "thread " + std::to_string(t)) << "\"}},\n";
+    for (auto &e : events)
+    {
+        double secs = (e.end - e.start) / 1e6;
+        out << "{\"name\":\"" << e.name << "\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":0,\"tid\":" << e.tid
+            << ",\"ts\":" << e.start << ",\"dur\":" << e.end - e.start
+            << ",\"args\":{\"bytes\":" << e.bytes
+            << ",\"MB/s\":" << (secs > 0 ? e.bytes / 1e6 / secs : 0)
+            << ",\"peak_rss_MB\":" << e.rss / 1e6 << "}},\n";
+    }
+    out << "{\"name\":\"peak_rss\",\"ph\":\"C\",\"pid\":0,\"tid\":0,\"ts\":" << trace_now()
+        << ",\"args\":{\"MB\":" << peak_rss() / 1e6 << "}}\n";
+    out << "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"peak_rss_bytes\":" << peak_rss()
+        << ",\"allocations\":{";
+    const char *sep = "";
+    for (auto &stage : allocation_stats())
+    {
+        out << sep << "\"" << (stage.first.empty() ? "other" : stage.first) << "\":{\"count\":" << stage.second.count
+            << ",\"bytes\":" << stage.second.bytes << ",\"reused\":" << stage.second.reused << "}";
+        sep = ",";
+    }
+    out << "}}}\n";
+    events.clear();
+}
@@ -0,0 +1,62 @@
+/*
+Copyright (c) <2018> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// Optional trace of the processing stages (-J file). Each span records its thread, start,
+// duration, bytes processed and the process's peak RSS when it ends. Thread pool workers
+// add a span named after the caller's open span for the time they spend in each job, so
+// per thread load balance shows up too. The file is Chrome trace event JSON, which
+// chrome://tracing and Perfetto display and any JSON reader can aggregate.
+// With tracing off a span only keeps track of the stage name on its thread, which the
+// allocation stats (-T) use.
+
+#include <cstddef>
+#include <string>
+
+void trace_start(const std::string &file);
+void trace_finish();                    // writes the file, then tracing is off
+bool tracing();
+double trace_now();                     // microseconds since trace_start()
+const char *trace_current();            // innermost open span on this thread, nullptr if none, tracing or not
+const char *trace_set_current(const char *name);   // for pool workers, returns the previous one
+// records a completed span on this thread
+void trace_event(const char *name, double start, double end, double bytes = 0);
+size_t peak_rss();                      // bytes, 0 if the platform can't tell
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name, double bytes = 0);
+    ~TraceSpan();
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+    void add_bytes(double n) { bytes += n; }
+private:
+    const char *name;
+    const char *outer;                  // span this one is nested in
+    double start;
+    double bytes;
+};
+
+#endif